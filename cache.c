@@ -0,0 +1,110 @@
+/*
+ * cache.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "cache.h"
+
+static long long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Writes the path of the entry of device 'dev', or of the lock if 'dev' is
+ * NULL, into buf. Entries are named after the device number, or the inode
+ * of other files, so that all paths to a device share one. Returns 0 or -1
+ * with errno set if 'dev' does not exist. */
+static int path(char *buf, size_t sz, const char *dev)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR") ? : "/tmp";
+	struct stat st;
+	if (!dev)
+		snprintf(buf, sz, "%s/korad-lock", dir);
+	else if (stat(dev, &st))
+		return -1;
+	else if (S_ISCHR(st.st_mode))
+		snprintf(buf, sz, "%s/korad-status-c%u:%u", dir,
+		         major(st.st_rdev), minor(st.st_rdev));
+	else
+		snprintf(buf, sz, "%s/korad-status-i%u:%u:%llu", dir,
+		         major(st.st_dev), minor(st.st_dev),
+		         (unsigned long long)st.st_ino);
+	return 0;
+}
+
+int cache_load(const char *dev, long long ttl_ns, struct status_cache *c)
+{
+	char p[4096];
+	struct stat st;
+	if (path(p, sizeof(p), dev))
+		return -1;
+	int fd = open(p, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	int r = fstat(fd, &st) || st.st_uid != getuid() ||
+	        st.st_size != sizeof(*c) ||
+	        read(fd, c, sizeof(*c)) != sizeof(*c) ? -1 : 0;
+	close(fd);
+	long long age = now_ns() - c->t_ns;
+	if (r || age < 0 || age >= ttl_ns)
+		return -1;
+	c->idn[KORAD_REPLY_MAX - 1] = '\0';
+	for (unsigned i = 0; i < 8; i++)
+		for (enum field f = 0; f < N_FIELDS; f++)
+			c->r[i][f][KORAD_REPLY_MAX - 1] = '\0';
+	return 0;
+}
+
+int cache_store(const char *dev, struct status_cache *c)
+{
+	char p[4096], tmp[4096 + 8];
+	if (path(p, sizeof(p), dev))
+		return -1;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", p);
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	c->t_ns = now_ns();
+	int r = write(fd, c, sizeof(*c)) == sizeof(*c) ? 0 : -1;
+	if (close(fd) || r || rename(tmp, p)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void cache_drop(const char *dev)
+{
+	char p[4096];
+	if (!path(p, sizeof(p), dev))
+		unlink(p);
+}
+
+int cache_lock(void)
+{
+	char p[4096];
+	path(p, sizeof(p), NULL);
+	int fd = open(p, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd != -1 && flock(fd, LOCK_EX)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
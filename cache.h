@@ -0,0 +1,44 @@
+/*
+ * cache.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "korad.h"
+#include "mon.h"
+
+/* The status last queried from a device, kept in a file per device in
+ * $XDG_RUNTIME_DIR, or /tmp if unset, for repeated calls to be answered
+ * without touching the device. The file is the same for all paths to the
+ * device. Files are replaced atomically and ignored unless owned by the
+ * user. */
+struct status_cache {
+	long long t_ns;           /* CLOCK_REALTIME time of the queries */
+	unsigned fields;          /* mask of the fields queried */
+	unsigned chans;           /* mask of the channels queried */
+	char idn[KORAD_REPLY_MAX];
+	char r[8][N_FIELDS][KORAD_REPLY_MAX]; /* replies per channel */
+};
+
+/* Reads the entry of device 'dev' into *c. Returns 0 if it exists and was
+ * stored less than 'ttl_ns' ago, -1 otherwise. */
+int  cache_load(const char *dev, long long ttl_ns, struct status_cache *c);
+
+/* Stores *c as the entry of device 'dev' with the current time. Returns 0
+ * on success and -1 with errno set on failure. */
+int  cache_store(const char *dev, struct status_cache *c);
+
+/* Removes the entry of device 'dev' after its state has been changed. */
+void cache_drop(const char *dev);
+
+/* Waits for and takes the lock serializing the queries of calls about to
+ * store entries, so that devices are queried at most once per TTL. Returns
+ * a file descriptor to close() to release it or -1 on failure. */
+int  cache_lock(void);
+
+#endif
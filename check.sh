@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# check.sh
+#
+# Copyright 2022 Franz Brauße <fb@paxle.org>
+#
+# SPDX: WTFPL
+#
+# Property checks of korad against the simulator, run by 'make check':
+# setpoints read back as sent in the model's format, and each process gets
+# the replies to its own queries whatever the previous one left behind, for
+# all framings of STATUS? and *IDN?. With the path of korad-test as an
+# argument, korad.hpp is checked against three simulated devices as well.
+
+cd "$(dirname "$0")" || exit 2
+
+# run by the simulator with the options for korad as arguments
+props='
+err=0
+expect() {
+	want=$1
+	shift
+	got=$(./korad "$@") || err=1
+	case $got in
+	$want) ;;
+	*) echo "korad $*: got \"$got\", expected \"$want\"" >&2; err=1 ;;
+	esac
+}
+for ui in 0:0 0.01:0.001 5:0.5 12.345:1.2345 29.99:3.1 30:5; do
+	./korad "$@" -U ${ui%:*} -I ${ui#*:} || err=1
+	v=$(printf %05.2f ${ui%:*}) a=$(printf %.3f ${ui#*:})
+	for n in 1 2; do
+		expect "set to ${v}V / ${a}A" "$@" -s -q vset,iset
+		expect "*output off (0x??)" "$@" -s -q status
+		expect "set to ${v}V" "$@" -s -q vset
+		expect "*output off (0x??), set to ${v}V / ${a}A, *" "$@" -s
+		expect "set to ${a}A" "$@" -s -q iset
+	done
+done
+# cached entries hold only the fields queried, also after expiring
+for ttl in 5000 200; do
+	expect "set to ${v}V" "$@" -A $ttl -s -q vset
+	sleep 0.3
+	expect "*output off (0x??)" "$@" -A $ttl -s -q status
+	expect "set to ${v}V" "$@" -A $ttl -s -q vset
+	expect "set to ${v}V / ${a}A" "$@" -A $ttl -s -q vset,iset
+done
+exit $err
+'
+
+XDG_RUNTIME_DIR=$(mktemp -d) || exit 2
+export XDG_RUNTIME_DIR
+trap 'rm -rf "$XDG_RUNTIME_DIR"' EXIT
+
+fail=0
+# korad options, then those of the simulator
+variant() {
+	k=$1
+	shift
+	if ! ./korad-sim "$@" sh -c "$props" sh $k; then
+		echo "failed: ./korad-sim $*" >&2
+		fail=1
+	fi
+}
+
+variant ""
+variant "" -u
+variant "" -c 2
+variant "" -u -i "KORAD KA3005P V2.0 SN:SIM00001"
+variant -f -i "ACME PSU V1.0"
+variant -f -u -i "ACME PSU V1.0"
+
+if [ -n "$1" ]; then
+	d=$XDG_RUNTIME_DIR
+	if ! ./korad-sim -l $d/a ./korad-sim -l $d/b ./korad-sim -l $d/c \
+	     "./$1" $d/a $d/b $d/c; then
+		echo "failed: $1" >&2
+		fail=1
+	fi
+fi
+
+[ $fail = 0 ] && echo "all checks passed"
+exit $fail
@@ -0,0 +1,74 @@
+/*
+ * fuzz-klog.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "klog.h"
+
+/* The input is a log followed by its index starting at the first occurrence
+ * of KLOG_IDX_MAGIC, as 'cat LOG LOG.idx' produces. Both are written to
+ * files, mapped and all segments are decoded like korad-log does. */
+
+static char *log_path, *idx_path;
+
+static void put(const char *path, const uint8_t *d, size_t n)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || write(fd, d, n) != (ssize_t)n || close(fd))
+		perror(path), exit(2);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (!log_path) {
+		const char *dir = getenv("TMPDIR") ? : "/tmp";
+		if (asprintf(&log_path, "%s/fuzz-klog.%d", dir, getpid()) < 0 ||
+		    asprintf(&idx_path, "%s.idx", log_path) < 0)
+			perror("asprintf"), exit(2);
+	}
+	const uint8_t *idx = memmem(data, size, KLOG_IDX_MAGIC, 4);
+	size_t n = idx ? (size_t)(idx - data) : size;
+	put(log_path, data, n);
+	if (idx)
+		put(idx_path, idx, size - n);
+	else
+		unlink(idx_path);
+
+	struct klog_map m;
+	int r = klog_map(&m, log_path);
+	unlink(log_path);
+	unlink(idx_path);
+	if (r)
+		return 0;
+	struct tlm_sample *prev = calloc(m.n ? m.n : 1, sizeof(*prev));
+	if (!prev)
+		perror("calloc"), exit(2);
+	for (size_t i = 0; i < m.n_segs; i++) {
+		struct klog_seg s;
+		klog_seg(&m, i, &s);
+		if (s.off > m.size || s.len > m.size - s.off)
+			abort();
+		const uint8_t *p = m.data + s.off, *end = p + s.len;
+		unsigned dev;
+		memset(prev, 0, m.n * sizeof(*prev));
+		while (tlm_decode(&p, end, m.n, &dev, prev) > 0)
+			if (dev >= m.n || p > end)
+				abort();
+		if (klog_find(&m, s.t_first) > m.n_segs)
+			abort();
+	}
+	free(prev);
+	klog_unmap(&m);
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * fuzz-korad.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "korad.h"
+
+/* Runs a handle against a connected socket whose other end plays the device.
+ * Each input byte is an operation, the low bits its argument:
+ *
+ *   00nnnnnn  the device sends the following n+1 input bytes
+ *   01...ccc  command c of cmds[] is submitted
+ *   10......  wait for a pending gap to pass
+ *   11......  the device sends a line terminator
+ *
+ * After each, korad_complete() is called until it makes no progress, the
+ * replies are checked to be those of the queries in submission order framed
+ * as the model says, and the commands written to be those submitted. */
+
+static const struct korad_frame_rule frames[] = {
+	{ "STATUS?", { 1, 0 } },
+	{ "*IDN?", { 0, 100000 } },
+	{ "VOUT", { 5, 0 } },
+	{ NULL },
+};
+
+static const struct korad_model model = {
+	.idn = "FUZZ", .name = "fuzz", .channels = 1,
+	.v_fmt = "%05.2f", .i_fmt = "%.3f",
+	.frames = frames,
+};
+
+static const char *const cmds[] = {
+	"STATUS?", "*IDN?", "VOUT1?", "ISET1?", "VSET1:01.00", "OUT1",
+	"VSET1:0123456789012345678901234567", "",
+};
+
+static struct {
+	unsigned id;
+	const char *cmd;
+} q[KORAD_QUEUE_MAX];
+static size_t q_head, q_len;
+
+/* submitted commands not read by the device yet */
+static char sent[KORAD_QUEUE_MAX * KORAD_CMD_MAX];
+static size_t sent_len;
+
+static void check(const struct korad_reply *r)
+{
+	if (!q_len || r->id != q[q_head].id ||
+	    strcmp(r->cmd, q[q_head].cmd) || r->len >= KORAD_REPLY_MAX ||
+	    r->data[r->len])
+		abort();
+	struct korad_framing f = korad_framing(&model, r->cmd);
+	if (f.len ? r->len != f.len : !!memchr(r->data, '\n', r->len))
+		abort();
+	q_head = (q_head + 1) % KORAD_QUEUE_MAX;
+	q_len--;
+}
+
+/* Makes progress on the handle, returns -1 once it failed. */
+static int complete(struct korad *k, int dev)
+{
+	struct korad_reply r;
+	int c;
+	while ((c = korad_complete(k, &r)) > 0 ||
+	       (c < 0 && errno == EOVERFLOW)) {
+		if (c > 0) {
+			check(&r);
+		} else if (q_len) {
+			/* the reply of the query was discarded */
+			q_head = (q_head + 1) % KORAD_QUEUE_MAX;
+			q_len--;
+		} else
+			abort();
+	}
+	char got[sizeof(sent)];
+	ssize_t rd;
+	while ((rd = read(dev, got, sizeof(got))) > 0) {
+		if ((size_t)rd > sent_len || memcmp(got, sent, rd))
+			abort();
+		memmove(sent, sent + rd, sent_len -= rd);
+	}
+	return c;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv))
+		perror("socketpair"), exit(2);
+	struct korad *k = korad_fdopen(sv[0]);
+	if (!k)
+		perror("korad_fdopen"), exit(2);
+	korad_set_model(k, &model);
+	q_head = q_len = sent_len = 0;
+
+	for (const uint8_t *p = data, *end = data + size; p < end;) {
+		unsigned op = *p++, arg = op & 0x3f;
+		size_t n;
+		switch (op >> 6) {
+		case 0:
+			n = arg + 1 < (size_t)(end - p) ? arg + 1 : end - p;
+			if (write(sv[1], p, n) < 0 && errno != EAGAIN)
+				abort();
+			p += n;
+			break;
+		case 1: {
+			const char *c = cmds[arg % 8];
+			unsigned id = korad_submit(k, 0, "%s", c);
+			if (!id)
+				break;
+			if (*c && c[strlen(c) - 1] == '?') {
+				size_t i = (q_head + q_len++) % KORAD_QUEUE_MAX;
+				q[i].id = id;
+				q[i].cmd = c;
+			}
+			if (sent_len + strlen(c) + 1 > sizeof(sent))
+				abort();
+			sent_len += sprintf(sent + sent_len, "%s\n", c);
+			break;
+		}
+		case 2:
+			/* for the gap ending *IDN? to pass */
+			if (korad_timeout(k) >= 0) {
+				struct timespec t = { 0, 200000 };
+				nanosleep(&t, NULL);
+			}
+			break;
+		case 3:
+			if (write(sv[1], "\n", 1) < 0 && errno != EAGAIN)
+				abort();
+			break;
+		}
+		if (complete(k, sv[1]) < 0)
+			break;
+	}
+	korad_close(k);
+	close(sv[1]);
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * fuzz-main.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Driver for the fuzzing harnesses when not linked with libFuzzer: runs the
+ * harness on each FILE, or stdin if there is none, as AFL expects, and with
+ * -runs=N on N random mutations of each. The mutations depend only on
+ * $FUZZ_SEED [1], rerunning reproduces a failure. */
+
+#define MAX_LEN		(1 << 16)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static size_t load(FILE *f, uint8_t *buf)
+{
+	size_t n = fread(buf, 1, MAX_LEN, f);
+	if (ferror(f))
+		perror("fread"), exit(2);
+	return n;
+}
+
+/* Changes a few bytes, inserts or removes a run of them. */
+static size_t mutate(uint8_t *buf, size_t n)
+{
+	static const uint8_t special[] = { 0, 0x7f, 0x80, 0xff, '\n', '?' };
+	for (unsigned k = 1 + random() % 4; k--;) {
+		size_t at = n ? random() % n : 0, len = 1 + random() % 8;
+		switch (random() % 5) {
+		case 0:
+			if (n)
+				buf[at] ^= 1 << random() % 8;
+			break;
+		case 1:
+			if (n)
+				buf[at] = special[random() % sizeof(special)];
+			break;
+		case 2:
+			if (n)
+				buf[at] = random();
+			break;
+		case 3:
+			if (len > MAX_LEN - n)
+				break;
+			memmove(buf + at + len, buf + at, n - at);
+			for (size_t i = 0; i < len; i++)
+				buf[at + i] = random();
+			n += len;
+			break;
+		case 4:
+			if (len > n - at)
+				len = n - at;
+			memmove(buf + at, buf + at + len, n - at - len);
+			n -= len;
+			break;
+		}
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t seed[MAX_LEN], buf[MAX_LEN];
+	unsigned long runs = 0;
+	int i = 1;
+	if (i < argc && !strncmp(argv[i], "-runs=", 6))
+		runs = strtoul(argv[i++] + 6, NULL, 0);
+	srandom(getenv("FUZZ_SEED") ? atoi(getenv("FUZZ_SEED")) : 1);
+
+	do {
+		FILE *f = i < argc ? fopen(argv[i], "rb") : stdin;
+		if (!f)
+			perror(argv[i]), exit(2);
+		size_t n = load(f, seed);
+		if (f != stdin)
+			fclose(f);
+		LLVMFuzzerTestOneInput(seed, n);
+		for (unsigned long r = 0; r < runs; r++) {
+			size_t m = n;
+			memcpy(buf, seed, n);
+			/* stack a few rounds of mutations */
+			for (unsigned d = 1 + random() % 3; d--;)
+				m = mutate(buf, m);
+			LLVMFuzzerTestOneInput(buf, m);
+		}
+	} while (++i < argc);
+	return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * fuzz-replay.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+/* Parses the input as a protocol trace like korad-replay does, checks the
+ * records lie within it in order and prints them to /dev/null. */
+
+#define main replay_main
+#include "korad-replay.c"
+#undef main
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	/* the warnings too, but sanitizers still report to descriptor 2 */
+	static FILE *null;
+	if (!null && (!(null = fopen("/dev/null", "w")) ||
+	              !freopen("/dev/null", "w", stdout)))
+		exit(2);
+	stderr = null;
+	if (parse("fuzz", data, size))
+		return 0;
+	size_t off = 0;
+	for (size_t i = 0; i < n_recs; i++) {
+		const struct rec *r = &recs[i];
+		if (r->data < data ||
+		    r->len > (size_t)(data + size - r->data) ||
+		    r->t < (i ? recs[i-1].t : 0) || r->off != off)
+			abort();
+		if (r->dir == KORAD_TRACE_READ)
+			off += r->len;
+	}
+	print_trace();
+	return 0;
+}
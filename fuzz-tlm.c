@@ -0,0 +1,62 @@
+/*
+ * fuzz-tlm.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlm.h"
+
+/* Decodes a stream as written by 'korad -b' for up to 8 devices and checks
+ * that encoding each decoded sample again, as a keyframe or relative to the
+ * previous one, decodes to the same sample. The header is skipped without
+ * checking its magic, version and fields. */
+
+static void same(const struct tlm_sample *a, const struct tlm_sample *b)
+{
+	if (a->t != b->t || a->valid != b->valid)
+		abort();
+	for (unsigned f = 0; f < TLM_FIELDS; f++)
+		if (a->valid & 1U << f && a->v[f] != b->v[f])
+			abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size < 6)
+		return 0;
+	const uint8_t *p = data + 6, *end = data + size;
+	uint64_t t0, n, len;
+	if (tlm_get_varint(&p, end, &t0) ||
+	    tlm_get_varint(&p, end, &n) || n > 8)
+		return 0;
+	for (unsigned i = 0; i < n; i++, p += len)
+		if (tlm_get_varint(&p, end, &len) || len > (size_t)(end - p))
+			return 0;
+
+	unsigned dev;
+	struct tlm_sample prev[8], enc[8], dec[8];
+	memset(prev, 0, sizeof(prev));
+	memset(enc, 0, sizeof(enc));
+	memset(dec, 0, sizeof(dec));
+
+	while (tlm_decode(&p, end, n, &dev, prev) > 0) {
+		uint8_t buf[TLM_REC_MAX];
+		const uint8_t *q = buf;
+		unsigned d;
+		/* a keyframe forgets fields it does not carry */
+		int key = (prev[dev].valid & enc[dev].valid) != enc[dev].valid;
+		size_t len = tlm_encode(buf, dev, &enc[dev], &prev[dev], key);
+		if (len > sizeof(buf) ||
+		    tlm_decode(&q, buf + len, n, &d, dec) != 1 ||
+		    q != buf + len || d != dev)
+			abort();
+		same(&prev[dev], &dec[dev]);
+		enc[dev] = prev[dev];
+	}
+	return 0;
+}
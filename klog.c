@@ -0,0 +1,303 @@
+/*
+ * klog.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "klog.h"
+
+struct klog {
+	FILE *f, *idx;
+	unsigned n;
+	uint64_t seg_us, seg_t, off; /* seg_t: time the segment was started */
+	struct tlm_sample *prev;   /* last record per device */
+	unsigned char *keyed;      /* device has a keyframe in the segment */
+	struct klog_seg cur;
+	int in_seg;
+};
+
+static void put_le(uint8_t *p, uint64_t v, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++, v >>= 8)
+		p[i] = v;
+}
+
+static uint64_t get_le(const uint8_t *p, unsigned n)
+{
+	uint64_t v = 0;
+	for (unsigned i = n; i--;)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static char * idx_path(const char *path)
+{
+	char *p;
+	return asprintf(&p, "%s.idx", path) == -1 ? NULL : p;
+}
+
+struct klog * klog_create(const char *path, unsigned fields, uint64_t t0,
+                          unsigned n, const char *const *names,
+                          uint64_t seg_us)
+{
+	struct klog *l = calloc(1, sizeof(*l));
+	char *ip = idx_path(path);
+	if (!l || !ip)
+		goto err;
+	l->n = n;
+	l->seg_us = seg_us;
+	l->prev = calloc(n, sizeof(*l->prev));
+	l->keyed = calloc(n, 1);
+	if (!l->prev || !l->keyed || !(l->f = fopen(path, "wb")) ||
+	    !(l->idx = fopen(ip, "wb")))
+		goto err;
+
+	uint8_t buf[2 * 10];
+	size_t len = tlm_put_varint(buf, t0);
+	len += tlm_put_varint(buf + len, n);
+	fprintf(l->f, "%s%c%c", TLM_MAGIC, TLM_VERSION, fields);
+	fwrite(buf, len, 1, l->f);
+	l->off = 6 + len;
+	for (unsigned i = 0; i < n; i++) {
+		size_t nl = strlen(names[i]);
+		len = tlm_put_varint(buf, nl);
+		fwrite(buf, len, 1, l->f);
+		fwrite(names[i], nl, 1, l->f);
+		l->off += len + nl;
+	}
+	fprintf(l->idx, "%s%c%c%c%c", KLOG_IDX_MAGIC, TLM_VERSION, 0, 0, 0);
+	if (ferror(l->f) || ferror(l->idx))
+		goto err;
+	free(ip);
+	return l;
+
+err:
+	if (l) {
+		int e = errno;
+		if (l->f)
+			fclose(l->f);
+		if (l->idx)
+			fclose(l->idx);
+		free(l->prev);
+		free(l->keyed);
+		free(l);
+		errno = e;
+	}
+	free(ip);
+	return NULL;
+}
+
+static void write_rec(struct klog *l, unsigned dev,
+                      const struct tlm_sample *s, int key)
+{
+	uint8_t buf[TLM_REC_MAX];
+	size_t n = tlm_encode(buf, dev, &l->prev[dev], s, key);
+	fwrite(buf, n, 1, l->f);
+	l->off += n;
+	l->cur.len += n;
+	l->cur.records++;
+	l->prev[dev] = *s;
+	l->keyed[dev] = 1;
+}
+
+static int finish(struct klog *l)
+{
+	uint8_t e[KLOG_IDX_ENTRY];
+	if (!l->in_seg)
+		return 0;
+	put_le(e +  0, l->cur.t_first, 8);
+	put_le(e +  8, l->cur.t_last, 8);
+	put_le(e + 16, l->cur.off, 8);
+	put_le(e + 24, l->cur.len, 4);
+	put_le(e + 28, l->cur.records, 4);
+	fwrite(e, sizeof(e), 1, l->idx);
+	l->in_seg = 0;
+	if (fflush(l->f) || fflush(l->idx))
+		return -1;
+	return 0;
+}
+
+/* Starts a new segment at time t with keyframes of all known devices. These
+ * repeat earlier samples with their times, which T_FIRST does not cover. */
+static void start(struct klog *l, uint64_t t)
+{
+	l->cur = (struct klog_seg){ .t_first = t, .t_last = t, .off = l->off };
+	l->seg_t = t;
+	l->in_seg = 1;
+	memset(l->keyed, 0, l->n);
+	for (unsigned i = 0; i < l->n; i++)
+		if (l->prev[i].valid) {
+			struct tlm_sample s = l->prev[i];
+			write_rec(l, i, &s, 1);
+		}
+}
+
+int klog_put(struct klog *l, unsigned dev, const struct tlm_sample *s)
+{
+	if (l->in_seg && (uint64_t)s->t - l->seg_t >= l->seg_us &&
+	    finish(l))
+		return -1;
+	if (!l->in_seg)
+		start(l, s->t);
+	if ((uint64_t)s->t > l->cur.t_last)
+		l->cur.t_last = s->t;
+	const struct tlm_sample *p = &l->prev[dev];
+	int key = !l->keyed[dev];
+	if (key || p->valid != s->valid || memcmp(p->v, s->v, sizeof(s->v)))
+		write_rec(l, dev, s, key);
+	return ferror(l->f) ? -1 : 0;
+}
+
+int klog_close(struct klog *l)
+{
+	int r = finish(l);
+	if (fclose(l->f))
+		r = -1;
+	if (fclose(l->idx))
+		r = -1;
+	free(l->prev);
+	free(l->keyed);
+	free(l);
+	return r;
+}
+
+static const uint8_t * map_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1)
+		return NULL;
+	void *p = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	else
+		errno = EINVAL;
+	int e = errno;
+	close(fd);
+	errno = e;
+	*size = st.st_size;
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int klog_map(struct klog_map *m, const char *path)
+{
+	memset(m, 0, sizeof(*m));
+	if (!(m->data = map_file(path, &m->size)))
+		return -1;
+
+	const uint8_t *p = m->data + 6, *end = m->data + m->size;
+	uint64_t n, len;
+	if (m->size < 6 || memcmp(m->data, TLM_MAGIC, 4) ||
+	    !m->data[4] || m->data[4] > TLM_VERSION ||
+	    tlm_get_varint(&p, end, &m->t0) ||
+	    tlm_get_varint(&p, end, &n) || n > (size_t)(end - p))
+		goto inval;
+	m->fields = m->data[5];
+	m->names = calloc(n ? n : 1, sizeof(*m->names));
+	if (!m->names)
+		goto err;
+	for (m->n = 0; m->n < n; m->n++) {
+		if (tlm_get_varint(&p, end, &len) || len > (size_t)(end - p))
+			goto inval;
+		if (!(m->names[m->n] = strndup((const char *)p, len)))
+			goto err;
+		p += len;
+	}
+	m->body = p - m->data;
+
+	char *ip = idx_path(path);
+	if (!ip)
+		goto err;
+	m->idx = map_file(ip, &m->idx_size);
+	free(ip);
+	if (m->idx && (m->idx_size < KLOG_IDX_HDR ||
+	               memcmp(m->idx, KLOG_IDX_MAGIC, 4))) {
+		munmap((void *)m->idx, m->idx_size);
+		m->idx = NULL;
+	}
+	size_t n_idx = m->idx ? (m->idx_size - KLOG_IDX_HDR) / KLOG_IDX_ENTRY
+	                      : 0;
+	struct klog_seg s = { .off = m->body };
+	if (n_idx)
+		klog_seg(m, n_idx - 1, &s);
+	m->n_segs = n_idx + (s.off + s.len < m->size);
+	return 0;
+
+inval:
+	errno = EINVAL;
+err:
+	klog_unmap(m);
+	return -1;
+}
+
+void klog_unmap(struct klog_map *m)
+{
+	int e = errno;
+	if (m->data)
+		munmap((void *)m->data, m->size);
+	if (m->idx)
+		munmap((void *)m->idx, m->idx_size);
+	for (unsigned i = 0; i < m->n; i++)
+		free(m->names[i]);
+	free(m->names);
+	memset(m, 0, sizeof(*m));
+	errno = e;
+}
+
+static size_t n_indexed(const struct klog_map *m)
+{
+	return m->idx ? (m->idx_size - KLOG_IDX_HDR) / KLOG_IDX_ENTRY : 0;
+}
+
+void klog_seg(const struct klog_map *m, size_t i, struct klog_seg *s)
+{
+	size_t n = n_indexed(m);
+	if (i < n) {
+		const uint8_t *e = m->idx + KLOG_IDX_HDR + i * KLOG_IDX_ENTRY;
+		s->t_first = get_le(e +  0, 8);
+		s->t_last  = get_le(e +  8, 8);
+		s->off     = get_le(e + 16, 8);
+		s->len     = get_le(e + 24, 4);
+		s->records = get_le(e + 28, 4);
+		/* do not trust the index beyond the log */
+		if (s->off > m->size || s->len > m->size - s->off)
+			s->off = m->size, s->len = 0;
+		return;
+	}
+	struct klog_seg prev = { .off = m->body };
+	if (n)
+		klog_seg(m, n - 1, &prev);
+	s->t_first = n ? prev.t_last : 0;
+	s->t_last = UINT64_MAX;
+	s->off = prev.off + prev.len;
+	s->len = m->size - s->off;
+	s->records = 0;
+}
+
+size_t klog_find(const struct klog_map *m, uint64_t t)
+{
+	size_t lo = 0, hi = n_indexed(m);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct klog_seg s;
+		klog_seg(m, mid, &s);
+		if (s.t_last < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < m->n_segs ? lo : m->n_segs;
+}
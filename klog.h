@@ -0,0 +1,86 @@
+/*
+ * klog.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "tlm.h"
+
+/* Segmented telemetry logs
+ *
+ * A log file consists of the header of a binary telemetry stream (tlm.h)
+ * followed by segments of records. Each segment starts with keyframes for
+ * all devices that have values at that point, so it can be decoded without
+ * the preceding ones. The sidecar index FILE.idx starts with
+ *
+ *   "KRDI" VERSION:u8 0:u8 0:u8 0:u8
+ *
+ * followed by one entry per completed segment of little-endian
+ *
+ *   T_FIRST:u64 T_LAST:u64 OFFSET:u64 LENGTH:u32 RECORDS:u32
+ *
+ * with times in microseconds since T0 as in the records, T_FIRST being the
+ * time the segment was started, and OFFSET relative to the start of the log
+ * file. Entries are sorted by time, so readers can binary search them.
+ * Records after the last indexed segment, e.g. after a crash, form one more
+ * segment for readers. */
+
+#define KLOG_IDX_MAGIC	"KRDI"
+#define KLOG_IDX_HDR	8
+#define KLOG_IDX_ENTRY	32
+
+struct klog;
+
+struct klog_seg {
+	uint64_t t_first, t_last, off;
+	uint32_t len, records;
+};
+
+/* Creates the log 'path' and its index. 'fields' is the mask of monitored
+ * fields, 't0' the CLOCK_REALTIME start time in microseconds, 'seg_us' the
+ * duration of a segment. Returns NULL with errno set on failure. */
+struct klog * klog_create(const char *path, unsigned fields, uint64_t t0,
+                          unsigned n, const char *const *names,
+                          uint64_t seg_us);
+
+/* Appends sample s of device 'dev' unless it equals the previous one of
+ * that device in the current segment. Returns 0 on success and -1 with errno
+ * set on failure. */
+int           klog_put(struct klog *l, unsigned dev,
+                       const struct tlm_sample *s);
+
+/* Finishes the last segment and closes the log. */
+int           klog_close(struct klog *l);
+
+/* Read-only view of a log mapped into memory. */
+struct klog_map {
+	const uint8_t *data;
+	size_t size;
+	const uint8_t *idx;      /* index entries, NULL if none */
+	size_t idx_size;
+	size_t n_segs;           /* including an unindexed tail */
+	unsigned fields, n;      /* field mask and number of devices */
+	uint64_t t0;
+	char **names;
+	size_t body;             /* offset of the first segment */
+};
+
+int    klog_map(struct klog_map *m, const char *path);
+void   klog_unmap(struct klog_map *m);
+
+/* Stores segment i in *s. */
+void   klog_seg(const struct klog_map *m, size_t i, struct klog_seg *s);
+
+/* Returns the index of the first segment containing samples at or after
+ * time t, n_segs if there is none. */
+size_t klog_find(const struct klog_map *m, uint64_t t);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * korad-analyze.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "klog.h"
+#include "mon.h"
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+/* samples decoded per device before they are aggregated */
+#define CHUNK		4096
+/* values are histogrammed in their native units of 10 mV and mA */
+#define HIST		65536
+#define MAX_THREADS	256
+
+_Static_assert(N_FIELDS == TLM_FIELDS, "monitor and log fields differ");
+
+/* Decoded samples of one device, stored as separate arrays so the
+ * aggregation loops vectorize. */
+struct buf {
+	int64_t t[CHUNK];
+	int32_t v[CHUNK], i[CHUNK];
+	uint8_t st[CHUNK];
+	size_t n;
+};
+
+/* A single decoded sample. */
+struct point {
+	int64_t t;
+	int32_t v, i;
+	uint8_t st;
+};
+
+/* Time-weighted sums over the intervals in which each sample held. */
+struct acc {
+	uint64_t time, on, cv, cc;
+	double energy, charge, vsum, isum;
+	uint64_t *vhist, *ihist;  /* time spent at each value */
+};
+
+struct part {
+	const struct klog_map *m;
+	size_t seg, n_segs;
+	int64_t from, to;
+	struct acc *acc;
+	struct buf *buf;
+	struct tlm_sample *prev;
+	unsigned char *seen;      /* per device: first[], last[] set */
+	struct point *first, *last;
+	int64_t t_end;
+	size_t records, bad;
+	pthread_t thread;
+};
+
+static void integrate(struct acc *a, const int64_t *t, const int64_t *tn,
+                      const int32_t *v, const int32_t *i, const uint8_t *st,
+                      size_t n, int64_t from, int64_t to)
+{
+	int64_t dt[CHUNK];
+	for (size_t k = 0; k < n; k++) {
+		int64_t lo = t[k] > from ? t[k] : from;
+		int64_t hi = tn[k] < to ? tn[k] : to;
+		dt[k] = hi > lo ? hi - lo : 0;
+	}
+	uint64_t time = 0, on = 0, cv = 0, cc = 0;
+	double energy = 0, charge = 0, vsum = 0, isum = 0;
+	for (size_t k = 0; k < n; k++) {
+		double d = dt[k];
+		time   += dt[k];
+		on     += st[k] & 0x40 ? dt[k] : 0;
+		cv     += (st[k] & 0x41) == 0x41 ? dt[k] : 0;
+		cc     += (st[k] & 0x41) == 0x40 ? dt[k] : 0;
+		energy += (double)v[k] * i[k] * d;
+		charge += i[k] * d;
+		vsum   += v[k] * d;
+		isum   += i[k] * d;
+	}
+	a->time += time;
+	a->on += on;
+	a->cv += cv;
+	a->cc += cc;
+	a->energy += energy;
+	a->charge += charge;
+	a->vsum += vsum;
+	a->isum += isum;
+	for (size_t k = 0; k < n; k++) {
+		a->vhist[v[k] < 0 ? 0 : v[k] >= HIST ? HIST-1 : v[k]] += dt[k];
+		a->ihist[i[k] < 0 ? 0 : i[k] >= HIST ? HIST-1 : i[k]] += dt[k];
+	}
+}
+
+/* Aggregates all but the last sample in b, which moves to the front. */
+static void flush(struct acc *a, struct buf *b, int64_t from, int64_t to)
+{
+	size_t n = b->n - 1;
+	integrate(a, b->t, b->t + 1, b->v, b->i, b->st, n, from, to);
+	b->t[0] = b->t[n];
+	b->v[0] = b->v[n];
+	b->i[0] = b->i[n];
+	b->st[0] = b->st[n];
+	b->n = 1;
+}
+
+static struct point point(const struct tlm_sample *s)
+{
+	return (struct point){
+		.t = s->t,
+		.v = s->valid & 1U << VOUT ? s->v[VOUT] : 0,
+		.i = s->valid & 1U << IOUT ? s->v[IOUT] : 0,
+		.st = s->valid & 1U << STATUS ? s->v[STATUS] : 0,
+	};
+}
+
+static void * run(void *arg)
+{
+	struct part *p = arg;
+	const struct klog_map *m = p->m;
+	for (size_t j = p->seg; j < p->seg + p->n_segs; j++) {
+		struct klog_seg s;
+		klog_seg(m, j, &s);
+		if (s.t_last != UINT64_MAX && (int64_t)s.t_last > p->t_end)
+			p->t_end = s.t_last;
+		const uint8_t *q = m->data + s.off, *end = q + s.len;
+		unsigned dev;
+		int r;
+		memset(p->prev, 0, m->n * sizeof(*p->prev));
+		while ((r = tlm_decode(&q, end, m->n, &dev, p->prev)) > 0) {
+			const struct tlm_sample *x = &p->prev[dev];
+			struct buf *b = &p->buf[dev];
+			p->records++;
+			if (x->t > p->t_end)
+				p->t_end = x->t;
+			/* skip keyframes repeating the previous segment */
+			if (b->n && x->t <= b->t[b->n - 1])
+				continue;
+			struct point y = point(x);
+			if (!p->seen[dev]) {
+				p->seen[dev] = 1;
+				p->first[dev] = y;
+			}
+			b->t[b->n] = y.t;
+			b->v[b->n] = y.v;
+			b->i[b->n] = y.i;
+			b->st[b->n++] = y.st;
+			if (b->n == CHUNK)
+				flush(&p->acc[dev], b, p->from, p->to);
+		}
+		if (r < 0)
+			p->bad++;
+	}
+	for (unsigned d = 0; d < m->n; d++) {
+		struct buf *b = &p->buf[d];
+		if (!b->n)
+			continue;
+		flush(&p->acc[d], b, p->from, p->to);
+		p->last[d] = (struct point){
+			.t = b->t[0], .v = b->v[0], .i = b->i[0], .st = b->st[0],
+		};
+	}
+	return NULL;
+}
+
+static void * xcalloc(size_t n, size_t sz)
+{
+	void *p = calloc(n ? n : 1, sz);
+	if (!p)
+		perror("calloc"), exit(2);
+	return p;
+}
+
+static void acc_init(struct acc *a)
+{
+	a->vhist = xcalloc(HIST, sizeof(*a->vhist));
+	a->ihist = xcalloc(HIST, sizeof(*a->ihist));
+}
+
+static void acc_add(struct acc *a, const struct acc *b)
+{
+	a->time += b->time;
+	a->on += b->on;
+	a->cv += b->cv;
+	a->cc += b->cc;
+	a->energy += b->energy;
+	a->charge += b->charge;
+	a->vsum += b->vsum;
+	a->isum += b->isum;
+	for (size_t k = 0; k < HIST; k++) {
+		a->vhist[k] += b->vhist[k];
+		a->ihist[k] += b->ihist[k];
+	}
+}
+
+/* Returns the smallest value at or below which a fraction 'q' of the time
+ * was spent. */
+static size_t quantile(const uint64_t *h, uint64_t total, double q)
+{
+	uint64_t sum = 0, lim = q * total;
+	size_t k = 0;
+	while (k < HIST - 1 && ((sum += h[k]) < lim || !sum))
+		k++;
+	return k;
+}
+
+static void print_dist(const char *name, const uint64_t *h, uint64_t total,
+                       double scale, const char *fmt)
+{
+	static const double q[] = { 0, .5, .9, .99, 1 };
+	static const char *const qn[] = { "min", "p50", "p90", "p99", "max" };
+	if (!total)
+		return;
+	printf("%-12s", name);
+	for (size_t j = 0; j < sizeof(q)/sizeof(*q); j++) {
+		printf(" %s ", qn[j]);
+		printf(fmt, quantile(h, total, q[j]) * scale);
+	}
+	printf("\n");
+}
+
+static void report(const struct klog_map *m, unsigned d, const struct acc *a)
+{
+	double t = a->time * 1e-6, mean = a->time ? 1.0 / a->time : 0;
+	if (m->n > 1)
+		printf("# %s\n", m->names[d]);
+	printf("%-12s %14.6f s\n", "time", t);
+	if (m->fields & 1U << STATUS) {
+		double pc = a->time ? 100.0 / a->time : 0;
+		printf("%-12s %14.6f s %6.2f %%\n", "output_on", a->on * 1e-6,
+		       a->on * pc);
+		printf("%-12s %14.6f s %6.2f %%\n", "cv", a->cv * 1e-6,
+		       a->cv * pc);
+		printf("%-12s %14.6f s %6.2f %%\n", "cc", a->cc * 1e-6,
+		       a->cc * pc);
+	}
+	if (m->fields & 1U << VOUT)
+		printf("%-12s %14.6f V\n", "vout_mean", a->vsum * mean * 1e-2);
+	if (m->fields & 1U << IOUT)
+		printf("%-12s %14.6f A\n", "iout_mean", a->isum * mean * 1e-3);
+	unsigned vi = 1U << VOUT | 1U << IOUT;
+	if ((m->fields & vi) == vi) {
+		double e = a->energy * 1e-11;
+		printf("%-12s %14.6f W\n", "power_mean", e / (t ? t : 1));
+		printf("%-12s %14.6f J %14.6f Wh\n", "energy", e, e / 3600);
+	}
+	if (m->fields & 1U << IOUT) {
+		double q = a->charge * 1e-9;
+		printf("%-12s %14.6f C %14.6f Ah\n", "charge", q, q / 3600);
+	}
+	if (m->fields & 1U << VOUT)
+		print_dist("vout/V", a->vhist, a->time, 1e-2, "%.2f");
+	if (m->fields & 1U << IOUT)
+		print_dist("iout/A", a->ihist, a->time, 1e-3, "%.3f");
+}
+
+static long long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	double from = 0, to = 1e300;
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int verbose = 0;
+
+	for (int opt; (opt = getopt(argc, argv, ":f:hj:t:v")) != -1;)
+		switch (opt) {
+		case 'f': from = atof(optarg); break;
+		case 't': to = atof(optarg); break;
+		case 'j': n_threads = atol(optarg); break;
+		case 'v': verbose = 1; break;
+		case 'h':
+			printf("\
+usage: %s [-OPTS] FILE\n\
+\n\
+Prints time, CV/CC residency, energy, charge, means and time-weighted\n\
+percentiles of the output of each device in a log written by 'korad -w FILE'\n\
+or a stream written by 'korad -b'. Each sample is taken to hold until the\n\
+next one of the same device.\n\
+\n\
+Options [defaults]:\n\
+  -h         print this help message\n\
+  -f SEC     analyze from SEC seconds after the start [0]\n\
+  -t SEC     analyze up to SEC seconds after the start [end]\n\
+  -j N       decode segments in N threads [number of CPUs]\n\
+  -v         print decoding statistics to stderr\n\
+\n\
+Written by Franz Brauße <fb@paxle.org>\n\
+", argv[0]);
+			exit(0);
+		case ':':
+			DIE(1,"error: option '-%c' requires a parameter\n",
+			    optopt);
+		case '?':
+			DIE(1,"error: unknown option '-%c'\n",optopt);
+		}
+	if (optind + 1 != argc)
+		DIE(1,"error: expected exactly one log file\n");
+	if (n_threads < 1 || n_threads > MAX_THREADS)
+		DIE(1,"error: number of threads must be in 1..%d\n",
+		    MAX_THREADS);
+
+	long long t_start = now_ns();
+	struct klog_map m;
+	if (klog_map(&m, argv[optind]))
+		perror(argv[optind]), exit(1);
+
+	int64_t t_from = from * 1e6, t_to = to < 9e12 ? to * 1e6 : INT64_MAX;
+	size_t lo = klog_find(&m, t_from), hi = lo;
+	for (struct klog_seg s; hi < m.n_segs; hi++) {
+		klog_seg(&m, hi, &s);
+		if ((int64_t)s.t_first > t_to)
+			break;
+	}
+	if ((size_t)n_threads > hi - lo)
+		n_threads = hi - lo ? hi - lo : 1;
+
+	/* contiguous ranges of segments, merged in order afterwards */
+	struct part *part = xcalloc(n_threads, sizeof(*part));
+	for (long j = 0; j < n_threads; j++) {
+		struct part *p = &part[j];
+		p->m = &m;
+		p->seg = lo + (hi - lo) * j / n_threads;
+		p->n_segs = lo + (hi - lo) * (j + 1) / n_threads - p->seg;
+		p->from = t_from;
+		p->to = t_to;
+		p->acc = xcalloc(m.n, sizeof(*p->acc));
+		for (unsigned d = 0; d < m.n; d++)
+			acc_init(&p->acc[d]);
+		p->buf = xcalloc(m.n, sizeof(*p->buf));
+		p->prev = xcalloc(m.n, sizeof(*p->prev));
+		p->seen = xcalloc(m.n, 1);
+		p->first = xcalloc(m.n, sizeof(*p->first));
+		p->last = xcalloc(m.n, sizeof(*p->last));
+		if ((errno = pthread_create(&p->thread, NULL, run, p)))
+			perror("pthread_create"), exit(2);
+	}
+	size_t records = 0, bad = 0;
+	int64_t t_end = 0;
+	for (long j = 0; j < n_threads; j++) {
+		pthread_join(part[j].thread, NULL);
+		records += part[j].records;
+		bad += part[j].bad;
+		if (part[j].t_end > t_end)
+			t_end = part[j].t_end;
+	}
+	if (bad)
+		fprintf(stderr, "%s: warning: %zu malformed segments\n",
+		        argv[optind], bad);
+
+	/* the last sample of each part holds until the first of the next one
+	 * and the very last one until the end of the log */
+	for (unsigned d = 0; d < m.n; d++) {
+		struct acc *a = &part[0].acc[d];
+		const struct point *pend = NULL;
+		for (long j = 0; j < n_threads; j++) {
+			struct part *p = &part[j];
+			if (j)
+				acc_add(a, &p->acc[d]);
+			if (!p->seen[d])
+				continue;
+			if (pend)
+				integrate(a, &pend->t, &p->first[d].t, &pend->v,
+				          &pend->i, &pend->st, 1, t_from, t_to);
+			pend = &p->last[d];
+		}
+		if (pend)
+			integrate(a, &pend->t, &t_end, &pend->v, &pend->i,
+			          &pend->st, 1, t_from, t_to);
+		report(&m, d, a);
+	}
+
+	if (verbose)
+		fprintf(stderr, "%zu records in %zu segments, %ld threads, "
+		        "%.3f ms\n", records, hi - lo, n_threads,
+		        (now_ns() - t_start) * 1e-6);
+	klog_unmap(&m);
+	return 0;
+}
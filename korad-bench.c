@@ -0,0 +1,165 @@
+/*
+ * korad-bench.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "korad.h"
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+/* time for a changed setpoint to be reported */
+#define SETTLE_US	1e6
+
+static struct korad *k;
+
+static void send(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	unsigned id = korad_vsubmit(k, 0, fmt, ap);
+	va_end(ap);
+	if (!id || korad_sync(k))
+		perror("send"), exit(2);
+}
+
+static const char * comm(const char *cmd)
+{
+	const char *r = korad_query(k, "%s", cmd);
+	if (!r)
+		DIE(2,"error reading %s output\n",cmd);
+	return r;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Prints one result line: metric, sample count, min, median, 99th
+ * percentile and max. The column layout is stable across versions. */
+static void report(const char *metric, double *v, size_t n, const char *unit)
+{
+	qsort(v, n, sizeof(*v), dbl_cmp);
+	printf("%-20s %6zu %12.3f %12.3f %12.3f %12.3f %s\n", metric, n,
+	       v[0], v[n/2], v[(n*99)/100], v[n-1], unit);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = getenv("KORAD_DEV") ? : "/dev/ttyACM0";
+	long n_queries = 1000, n_reps = 100;
+
+	for (int opt; (opt = getopt(argc, argv, ":D:hn:r:")) != -1;)
+		switch (opt) {
+		case 'D': dev = optarg; break;
+		case 'n': n_queries = atol(optarg); break;
+		case 'r': n_reps = atol(optarg); break;
+		case 'h':
+			printf("\
+usage: %s [-OPTS]\n\
+\n\
+Measures query throughput, setpoint-change latency and status-block latency.\n\
+Changes the voltage setpoint of the device and restores it afterwards.\n\
+\n\
+Options [defaults]:\n\
+  -h         print this help message\n\
+  -D DEV     use device path DEV [%s]\n\
+  -n N       number of queries for the throughput measurement [%ld]\n\
+  -r N       number of repetitions for latency measurements [%ld]\n\
+\n\
+Environment variables:\n\
+  KORAD_DEV  default device to use unless -D is specified\n\
+\n\
+Written by Franz Brauße <fb@paxle.org>\n\
+", argv[0], dev, n_queries, n_reps);
+			exit(0);
+		case ':':
+			DIE(1,"error: option '-%c' requires a parameter\n",
+			    optopt);
+		case '?':
+			DIE(1,"error: unknown option '-%c'\n",optopt);
+		}
+
+	if (n_queries <= 0 || n_reps <= 0)
+		DIE(1,"error: sample counts must be positive\n");
+
+	k = korad_open(dev);
+	if (!k)
+		perror(dev), exit(1);
+
+	printf("# korad-bench 1: metric n min median p99 max unit\n");
+	const char *id = comm("*IDN?");
+	printf("# device: %s\n", id);
+	const struct korad_model *m = korad_model(id);
+	korad_set_model(k, m ? m : &korad_generic);
+
+	double *v = malloc(sizeof(*v) * (n_queries > n_reps ? n_queries
+	                                                    : n_reps));
+	if (!v)
+		perror("malloc"), exit(2);
+
+	double t0 = now_us();
+	for (long i = 0; i < n_queries; i++) {
+		double t = now_us();
+		comm("VOUT1?");
+		v[i] = now_us() - t;
+	}
+	double rate = n_queries / ((now_us() - t0) * 1e-6);
+	report("query_latency", v, n_queries, "us");
+	printf("%-20s %6ld %12.3f %12.3f %12.3f %12.3f q/s\n", "query_rate",
+	       n_queries, rate, rate, rate, rate);
+
+	char orig[16], want[16];
+	snprintf(orig, sizeof(orig), "%s", comm("VSET1?"));
+	for (long i = 0; i < n_reps; i++) {
+		snprintf(want, sizeof(want), korad_get_model(k)->v_fmt,
+		         i & 1 ? 1.0 : 2.0);
+		double t = now_us();
+		send("VSET1:%s", want);
+		while (strcmp(comm("VSET1?"), want))
+			if (now_us() - t > SETTLE_US) {
+				send("VSET1:%s", orig);
+				DIE(2,"error: VSET1? did not report %s within "
+				    "%.0f ms\n",want,SETTLE_US * 1e-3);
+			}
+		v[i] = now_us() - t;
+	}
+	send("VSET1:%s", orig);
+	report("setpoint_latency", v, n_reps, "us");
+
+	for (long i = 0; i < n_reps; i++) {
+		double t = now_us();
+		comm("STATUS?");
+		comm("VSET1?");
+		comm("ISET1?");
+		comm("VOUT1?");
+		comm("IOUT1?");
+		v[i] = now_us() - t;
+	}
+	report("status_latency", v, n_reps, "us");
+
+	free(v);
+	korad_close(k);
+}
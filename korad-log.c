@@ -0,0 +1,128 @@
+/*
+ * korad-log.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "klog.h"
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+static void print(const struct klog_map *m, unsigned dev,
+                  const struct tlm_sample *s)
+{
+	printf("%.6f", s->t * 1e-6);
+	if (m->n > 1)
+		printf(" %s", m->names[dev]);
+	for (unsigned f = 0; f < TLM_FIELDS; f++)
+		if (m->fields & 1U << f) {
+			putchar(' ');
+			if (s->valid & 1U << f)
+				tlm_print(stdout, f, s->v[f]);
+			else
+				putchar('-');
+		}
+	putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+	double from = 0, to = 1e300;
+	int list = 0;
+
+	for (int opt; (opt = getopt(argc, argv, ":f:hlt:")) != -1;)
+		switch (opt) {
+		case 'f': from = atof(optarg); break;
+		case 't': to = atof(optarg); break;
+		case 'l': list = 1; break;
+		case 'h':
+			printf("\
+usage: %s [-OPTS] FILE\n\
+\n\
+Prints the samples of a log written by 'korad -w FILE' as text.\n\
+\n\
+Options [defaults]:\n\
+  -h         print this help message\n\
+  -f SEC     print samples from SEC seconds after the start [0]\n\
+  -t SEC     print samples up to SEC seconds after the start [end]\n\
+  -l         list the segments instead of printing samples\n\
+\n\
+Written by Franz Brauße <fb@paxle.org>\n\
+", argv[0]);
+			exit(0);
+		case ':':
+			DIE(1,"error: option '-%c' requires a parameter\n",
+			    optopt);
+		case '?':
+			DIE(1,"error: unknown option '-%c'\n",optopt);
+		}
+	if (optind + 1 != argc)
+		DIE(1,"error: expected exactly one log file\n");
+
+	struct klog_map m;
+	if (klog_map(&m, argv[optind]))
+		perror(argv[optind]), exit(1);
+
+	if (list) {
+		printf("# t0/us %" PRIu64 ", %zu segments: first/s last/s "
+		       "offset length records\n", m.t0, m.n_segs);
+		for (size_t i = 0; i < m.n_segs; i++) {
+			struct klog_seg s;
+			klog_seg(&m, i, &s);
+			printf("%.6f %.6f %" PRIu64 " %" PRIu32 " %" PRIu32 "\n",
+			       s.t_first * 1e-6,
+			       s.t_last == UINT64_MAX ? -1 : s.t_last * 1e-6,
+			       s.off, s.len, s.records);
+		}
+		klog_unmap(&m);
+		return 0;
+	}
+
+	printf("# t0/us %" PRIu64 "\n# t/s%s", m.t0, m.n > 1 ? " dev" : "");
+	for (unsigned f = 0; f < TLM_FIELDS; f++)
+		if (m.fields & 1U << f)
+			printf(" %s", tlm_names[f]);
+	printf("\n");
+
+	struct tlm_sample prev[m.n ? m.n : 1];
+	/* keyframes at the start of a segment repeat the last samples */
+	int64_t last[m.n ? m.n : 1];
+	for (unsigned i = 0; i < m.n; i++)
+		last[i] = -1;
+	uint64_t t_from = from * 1e6, t_to = to < 1.8e13 ? to * 1e6 : UINT64_MAX;
+	for (size_t i = klog_find(&m, t_from); i < m.n_segs; i++) {
+		struct klog_seg s;
+		klog_seg(&m, i, &s);
+		if (s.t_first > t_to)
+			break;
+		const uint8_t *p = m.data + s.off, *end = p + s.len;
+		unsigned dev;
+		int r;
+		memset(prev, 0, sizeof(prev));
+		while ((r = tlm_decode(&p, end, m.n, &dev, prev)) > 0)
+			if ((uint64_t)prev[dev].t >= t_from &&
+			    (uint64_t)prev[dev].t <= t_to &&
+			    prev[dev].t > last[dev]) {
+				print(&m, dev, &prev[dev]);
+				last[dev] = prev[dev].t;
+			}
+		if (r < 0)
+			fprintf(stderr, "%s: warning: segment %zu malformed at "
+			        "offset %zu\n", argv[optind], i,
+			        (size_t)(p - m.data));
+	}
+
+	klog_unmap(&m);
+	return 0;
+}
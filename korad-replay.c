@@ -0,0 +1,501 @@
+/*
+ * korad-replay.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#include "korad.h"
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+/* time to wait for replies recorded in the trace */
+#define REPLY_NS	1000000000LL
+
+struct rec {
+	long long t;            /* ns since the start of the trace */
+	unsigned dir;
+	const unsigned char *data;
+	size_t len;
+	size_t off;             /* of read data in the concatenated replies */
+};
+
+static struct rec *recs;
+static size_t n_recs;
+static uint64_t t0;
+
+static int get_varint(const unsigned char **p, const unsigned char *end,
+                      uint64_t *v)
+{
+	*v = 0;
+	for (unsigned sh = 0; *p < end && sh < 64; sh += 7) {
+		unsigned char b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << sh;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+/* Sets up the records of the trace in buf, which must stay valid, and
+ * returns 0 or -1 if it is not a protocol trace. */
+static int parse(const char *path, const unsigned char *buf, size_t size)
+{
+	const unsigned char *p = buf + 5, *end = buf + size;
+	n_recs = 0;
+	if (size < 5 || memcmp(buf, KORAD_TRACE_MAGIC, 4) ||
+	    buf[4] != KORAD_TRACE_VERSION || get_varint(&p, end, &t0))
+		return -1;
+	long long t = 0;
+	size_t off = 0;
+	for (uint64_t dt, ld; p < end;) {
+		if (get_varint(&p, end, &dt) || get_varint(&p, end, &ld) ||
+		    ld >> 1 > (size_t)(end - p) ||
+		    dt > (uint64_t)LLONG_MAX - t) {
+			fprintf(stderr, "%s: warning: truncated or corrupt at "
+			        "offset %zu\n", path, (size_t)(p - buf));
+			break;
+		}
+		if (!(n_recs & (n_recs + 1)) &&
+		    !(recs = realloc(recs, 2 * (n_recs + 1) * sizeof(*recs))))
+			perror("realloc"), exit(2);
+		struct rec *r = &recs[n_recs++];
+		r->t = t += dt;
+		r->dir = ld & 1;
+		r->len = ld >> 1;
+		r->data = p;
+		r->off = off;
+		if (r->dir == KORAD_TRACE_READ)
+			off += r->len;
+		p += r->len;
+	}
+	return 0;
+}
+
+static void load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	struct stat st;
+	if (!f || fstat(fileno(f), &st))
+		perror(path), exit(1);
+	unsigned char *buf = malloc(st.st_size ? st.st_size : 1);
+	if (!buf || fread(buf, 1, st.st_size, f) != (size_t)st.st_size)
+		perror(path), exit(1);
+	fclose(f);
+	if (parse(path, buf, st.st_size))
+		DIE(1,"%s: error: not a protocol trace\n",path);
+}
+
+static void print_data(const unsigned char *d, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		if (d[i] == '\n')
+			printf("\\n");
+		else if (d[i] == '\\')
+			printf("\\\\");
+		else if (d[i] >= 0x20 && d[i] < 0x7f)
+			putchar(d[i]);
+		else
+			printf("\\x%02x", d[i]);
+}
+
+static void print_trace(void)
+{
+	printf("# t0/us %" PRIu64 "\n# t/s gap/ms dir data\n", t0);
+	for (size_t i = 0; i < n_recs; i++) {
+		const struct rec *r = &recs[i];
+		printf("%.9f %9.3f %c ", r->t * 1e-9,
+		       (r->t - (i ? recs[i-1].t : 0)) * 1e-6,
+		       r->dir == KORAD_TRACE_WRITE ? '>' : '<');
+		print_data(r->data, r->len);
+		printf("\n");
+	}
+}
+
+static long long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* replay state */
+static int fd, verbose;
+static unsigned char *got;
+static size_t got_len, exp_len, differ;
+static size_t next_read;        /* first read record not yet complete */
+static long long t_start, t_wr; /* start of replay, last write */
+static long long t_wr_orig;     /* trace time of the last write */
+static double lat_sum, lat_max;
+static size_t n_lat;
+
+/* Reads what the device sent and accounts for completed read records. */
+static void input(void)
+{
+	ssize_t rd = 1;
+	while (got_len < exp_len &&
+	       (rd = read(fd, got + got_len, exp_len - got_len)) > 0) {
+		long long t = now_ns();
+		for (size_t i = got_len; i < got_len + rd; i++) {
+			const struct rec *r;
+			for (size_t j = next_read;; j++)
+				if ((r = &recs[j])->dir == KORAD_TRACE_READ &&
+				    i < r->off + r->len)
+					break;
+			if (got[i] != r->data[i - r->off] &&
+			    (!differ++ || verbose > 1))
+				fprintf(stderr, "byte %zu: expected 0x%02x, "
+				        "got 0x%02x\n", i, r->data[i - r->off],
+				        got[i]);
+		}
+		got_len += rd;
+		/* reply latencies relative to the preceding write */
+		for (; next_read < n_recs; next_read++) {
+			const struct rec *r = &recs[next_read];
+			if (r->dir == KORAD_TRACE_WRITE) {
+				t_wr_orig = r->t;
+				continue;
+			}
+			if (got_len < r->off + r->len)
+				break;
+			double d = ((t - t_wr) - (r->t - t_wr_orig)) * 1e-6;
+			lat_sum += d;
+			lat_max = n_lat++ && lat_max > d ? lat_max : d;
+			if (verbose) {
+				printf("%.9f < ", (t - t_start) * 1e-9);
+				print_data(got + r->off, r->len);
+				printf(" (%+.3f ms)\n", d);
+			}
+		}
+	}
+	if (rd == 0)
+		DIE(2,"error: device closed\n");
+	if (rd < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+	    errno != EINTR)
+		perror("read"), exit(2);
+}
+
+/* Waits until 'off' bytes were read or time 'until', whichever is first.
+ * Returns whether all of them arrived. */
+static int wait_input(size_t off, long long until)
+{
+	for (long long t; input(), got_len < off && (t = now_ns()) < until;) {
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		struct timespec ts = { (until - t) / 1000000000,
+		                       (until - t) % 1000000000 };
+		if (ppoll(&p, 1, &ts, NULL) == -1 && errno != EINTR)
+			perror("poll"), exit(2);
+	}
+	return got_len >= off;
+}
+
+static void output(const unsigned char *d, size_t n)
+{
+	for (size_t off = 0; off < n;) {
+		ssize_t wr = write(fd, d + off, n - off);
+		if (wr > 0)
+			off += wr;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			struct pollfd p = { .fd = fd, .events = POLLOUT };
+			poll(&p, 1, -1);
+		} else if (errno != EINTR)
+			perror("write"), exit(2);
+	}
+}
+
+static int replay(const char *dev, double speed)
+{
+	if ((fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1)
+		perror(dev), exit(1);
+	for (size_t i = 0; i < n_recs; i++)
+		if (recs[i].dir == KORAD_TRACE_READ)
+			exp_len = recs[i].off + recs[i].len;
+	if (!(got = malloc(exp_len ? exp_len : 1)))
+		perror("malloc"), exit(2);
+
+	size_t n_wr = 0, wr_bytes = 0;
+	t_start = now_ns();
+	for (size_t i = 0; i < n_recs; i++) {
+		const struct rec *r = &recs[i];
+		if (r->dir != KORAD_TRACE_WRITE)
+			continue;
+		/* keep the order of the trace: all replies preceding this
+		 * write must have arrived */
+		size_t off = 0;
+		for (size_t j = i; j--;)
+			if (recs[j].dir == KORAD_TRACE_READ) {
+				off = recs[j].off + recs[j].len;
+				break;
+			}
+		if (!wait_input(off, now_ns() + REPLY_NS)) {
+			fprintf(stderr, "error: replies before record %zu "
+			        "incomplete, stopping\n", i);
+			break;
+		}
+		if (speed > 0)
+			wait_input(exp_len + 1, t_start + r->t / speed);
+		t_wr = now_ns();
+		output(r->data, r->len);
+		if (verbose) {
+			printf("%.9f > ", (t_wr - t_start) * 1e-9);
+			print_data(r->data, r->len);
+			printf("\n");
+		}
+		n_wr++;
+		wr_bytes += r->len;
+	}
+	wait_input(exp_len, now_ns() + REPLY_NS);
+
+	printf("%zu writes of %zu bytes, %zu of %zu bytes read back, %zu "
+	       "differ\n", n_wr, wr_bytes, got_len, exp_len, differ);
+	if (n_lat)
+		printf("reply latency vs trace: mean %+.3f ms, max %+.3f ms\n",
+		       lat_sum / n_lat, lat_max);
+	close(fd);
+	return got_len == exp_len && !differ ? 0 : 3;
+}
+
+/* serving state */
+static size_t in_len, in_differ; /* bytes received from the client */
+
+/* Reads what the client wrote and compares it to the 'n' bytes of all
+ * write records 'exp'. */
+static void client_input(const unsigned char *exp, size_t n)
+{
+	unsigned char buf[256];
+	ssize_t rd;
+	while ((rd = read(fd, buf, sizeof(buf))) > 0)
+		for (ssize_t i = 0; i < rd; i++, in_len++)
+			if (in_len < n && buf[i] != exp[in_len] &&
+			    (!in_differ++ || verbose > 1))
+				fprintf(stderr, "byte %zu: expected 0x%02x, "
+				        "got 0x%02x\n", in_len, exp[in_len],
+				        buf[i]);
+	if (rd < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+	    errno != EINTR)
+		perror("read"), exit(2);
+}
+
+/* Waits until the client wrote 'off' bytes or time 'until', whichever is
+ * first. Returns 1 if the client process 'child' exited meanwhile, its
+ * status is then stored in *status, and 0 otherwise. */
+static int wait_client(const unsigned char *exp, size_t n, size_t off,
+                       long long until, pid_t child, int *status)
+{
+	for (;;) {
+		client_input(exp, n);
+		if (in_len >= off)
+			return 0;
+		if (child && waitpid(child, status, WNOHANG) == child)
+			return 1;
+		long long t = now_ns(), d = until - t;
+		if (d <= 0)
+			return 0;
+		/* notice the client exiting */
+		if (child && d > 20000000)
+			d = 20000000;
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		struct timespec ts = { d / 1000000000, d % 1000000000 };
+		if (ppoll(&p, 1, &ts, NULL) == -1 && errno != EINTR)
+			perror("poll"), exit(2);
+	}
+}
+
+static int open_pty(const char **path, int *slave)
+{
+	int m = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (m == -1 || grantpt(m) || unlockpt(m) || !(*path = ptsname(m)))
+		perror("pty"), exit(2);
+
+	/* Keep the slave open so the master does not see EOF between
+	 * consecutive clients; it also carries the shared termios. */
+	int s = open(*path, O_RDWR | O_NOCTTY);
+	struct termios t;
+	if (s == -1 || tcgetattr(s, &t))
+		perror(*path), exit(2);
+	cfmakeraw(&t);
+	if (tcsetattr(s, TCSANOW, &t))
+		perror("tcsetattr"), exit(2);
+	*slave = s;
+	return m;
+}
+
+/* Plays the device of the trace on a pseudo-terminal: each reply is sent
+ * once the commands preceding it have been received, after the gap to the
+ * last of them in the trace. Runs argv if not empty with KORAD_DEV pointing
+ * to it. Returns its exit status if non-zero, otherwise 3 if the commands
+ * received differ from the trace and 0 if not. */
+static int serve(const char *link, double speed, char **argv)
+{
+	const char *path;
+	int s;
+	fd = open_pty(&path, &s);
+	if (link) {
+		unlink(link);
+		if (symlink(path, link))
+			perror(link), exit(2);
+	}
+
+	size_t n = 0, n_rd = 0, off = 0;
+	for (size_t i = 0; i < n_recs; i++)
+		if (recs[i].dir == KORAD_TRACE_WRITE)
+			n += recs[i].len;
+	unsigned char *exp = malloc(n ? n : 1);
+	if (!exp)
+		perror("malloc"), exit(2);
+	for (size_t i = 0; i < n_recs; i++)
+		if (recs[i].dir == KORAD_TRACE_WRITE) {
+			memcpy(exp + off, recs[i].data, recs[i].len);
+			off += recs[i].len;
+		}
+
+	pid_t child = 0;
+	if (*argv) {
+		if ((child = fork()) == -1)
+			perror("fork"), exit(2);
+		if (!child) {
+			setenv("KORAD_DEV", path, 1);
+			execvp(argv[0], argv);
+			perror(argv[0]);
+			_exit(127);
+		}
+	} else
+		printf("%s\n", path), fflush(stdout);
+
+	int status = 0, done = 0;
+	long long t_in = now_ns(), t_wr_orig = 0;
+	off = 0;
+	for (size_t i = 0; i < n_recs && !done; i++) {
+		const struct rec *r = &recs[i];
+		if (r->dir == KORAD_TRACE_WRITE) {
+			off += r->len;
+			done = wait_client(exp, n, off, LLONG_MAX, child,
+			                   &status);
+			t_in = now_ns();
+			t_wr_orig = r->t;
+			continue;
+		}
+		if (speed > 0)
+			done = wait_client(exp, n, SIZE_MAX, t_in +
+			                   (r->t - t_wr_orig) / speed, child,
+			                   &status);
+		if (done)
+			break;
+		output(r->data, r->len);
+		if (verbose) {
+			printf("%.9f < ", (now_ns() - t_in) * 1e-9);
+			print_data(r->data, r->len);
+			printf("\n");
+		}
+		n_rd++;
+	}
+	while (child && !done)
+		done = wait_client(exp, n, SIZE_MAX, LLONG_MAX, child,
+		                   &status);
+	/* the client has to read the last replies before the pseudo-terminal
+	 * goes away */
+	long long until = now_ns() + REPLY_NS;
+	while (!child && now_ns() < until) {
+		int left;
+		if (ioctl(s, FIONREAD, &left) || !left)
+			break;
+		wait_client(exp, n, SIZE_MAX, now_ns() + 1000000, 0, NULL);
+	}
+
+	fprintf(stderr, "%zu replies served, %zu of %zu command bytes "
+	        "received, %zu differ\n", n_rd, in_len, n, in_differ);
+	if (link)
+		unlink(link);
+	free(exp);
+	if (child && WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	if (child && WEXITSTATUS(status))
+		return WEXITSTATUS(status);
+	return in_len == n && !in_differ ? 0 : 3;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = getenv("KORAD_DEV") ? : "/dev/ttyACM0";
+	double speed = 1;
+	const char *link = NULL;
+	int print = 0, device = 0;
+
+	for (int opt; (opt = getopt(argc, argv, "+:D:dhl:ps:v")) != -1;)
+		switch (opt) {
+		case 'D': dev = optarg; break;
+		case 'd': device = 1; break;
+		case 'l': link = optarg; break;
+		case 'p': print = 1; break;
+		case 's': speed = atof(optarg); break;
+		case 'v': verbose++; break;
+		case 'h':
+			printf("\
+usage: %s [-OPTS] TRACE\n\
+       %s -d [-OPTS] TRACE [CMD [ARGS...]]\n\
+\n\
+Replays the commands of a protocol trace recorded by 'korad -t TRACE' to a\n\
+device, e.g. one simulated by korad-sim, with the original gaps and checks\n\
+the replies against the trace. A command is written only after the replies\n\
+preceding it in the trace arrived.\n\
+\n\
+With -d, plays the device instead: the recorded replies are sent on a\n\
+pseudo-terminal, each after the commands preceding it have been received\n\
+and the original gap since the last of them, and the commands are checked\n\
+against the trace. If CMD is given, it is run with KORAD_DEV pointing to\n\
+the pseudo-terminal and a non-zero exit status of it is returned, otherwise\n\
+the path is printed and the replies are served until the trace ends.\n\
+\n\
+Options [defaults]:\n\
+  -h         print this help message\n\
+  -d         play the device of the trace on a pseudo-terminal\n\
+  -D DEV     use device path DEV [%s]\n\
+  -l PATH    with -d, create symlink PATH to the pseudo-terminal\n\
+  -p         print the trace as text instead of replaying it\n\
+  -s SPEED   replay SPEED times as fast, 0 for no gaps at all [1]\n\
+  -v         print the bytes exchanged, twice: also every differing byte\n\
+\n\
+Environment variables:\n\
+  KORAD_DEV  default device to use unless -D is specified\n\
+\n\
+Written by Franz Brauße <fb@paxle.org>\n\
+", argv[0], argv[0], dev);
+			exit(0);
+		case ':':
+			DIE(1,"error: option '-%c' requires a parameter\n",
+			    optopt);
+		case '?':
+			DIE(1,"error: unknown option '-%c'\n",optopt);
+		}
+	if (optind + 1 != argc && !(device && optind < argc))
+		DIE(1,"error: expected exactly one trace file\n");
+	if (speed < 0)
+		DIE(1,"error: invalid speed '%g'\n",speed);
+
+	load(argv[optind]);
+	if (print) {
+		print_trace();
+		return 0;
+	}
+	if (device)
+		return serve(link, speed, argv + optind + 1);
+	return replay(dev, speed);
+}
@@ -0,0 +1,289 @@
+/*
+ * korad-sim.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+#define ARRAY_SIZE(a)	(sizeof(a)/sizeof(*(a)))
+
+/* State of the simulated KD3005P or, with two channels, KA3305P. Output
+ * values follow from a purely resistive load of 'load' Ohm per channel.
+ * Channels are 1-based in commands. */
+#define MAX_CH	2
+
+static struct {
+	struct { double uset, iset; } ch[MAX_CH];
+	double load;
+	unsigned channels;
+	int out, ocp;
+	struct { double uset, iset; } slot[5][MAX_CH];
+} psu = {
+	.ch = { { 5.0, 1.0 }, { 5.0, 1.0 } },
+	.load = 10.0,
+	.channels = 1,
+};
+
+#define IDN_1CH	"KORAD KD3005P V6.6 SN:SIM00001"
+#define IDN_2CH	"KORAD KA3305P V2.0 SN:SIM00001"
+#define IDN_RAW	"KORAD KD3005P V2.0 SN:SIM00001"
+
+static const char *idn;
+static long reply_ns;
+static int raw_status;
+
+static double iout(unsigned c)
+{
+	if (!psu.out)
+		return 0;
+	double i = psu.ch[c].uset / psu.load;
+	return i < psu.ch[c].iset ? i : psu.ch[c].iset;
+}
+
+static double uout(unsigned c)
+{
+	return iout(c) * psu.load;
+}
+
+static int cv_mode(unsigned c)
+{
+	return !psu.out || psu.ch[c].uset / psu.load < psu.ch[c].iset;
+}
+
+static void transmit(int m, const char *buf, ssize_t n)
+{
+	for (struct timespec rem = { reply_ns / 1000000000L,
+	                             reply_ns % 1000000000L };
+	     (errno = 0, nanosleep(&rem, &rem) == -1) && errno == EINTR;);
+	for (ssize_t wr, off = 0; off < n; off += wr)
+		if ((wr = write(m, buf + off, n - off)) < 0)
+			perror("write"), exit(2);
+}
+
+static void reply(int m, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	buf[n++] = '\n';
+	transmit(m, buf, n);
+}
+
+static int slot_nr(const char *arg)
+{
+	int n = atoi(arg);
+	return 1 <= n && n <= (int)ARRAY_SIZE(psu.slot) ? n - 1 : -1;
+}
+
+/* Returns the 0-based channel if cmd is 'name' followed by a valid channel
+ * number and 'sep', -1 otherwise. */
+static int chan_cmd(const char *cmd, const char *name, char sep)
+{
+	size_t n = strlen(name);
+	if (strncmp(cmd, name, n) || cmd[n] < '1' ||
+	    cmd[n] > '0' + (int)psu.channels || cmd[n+1] != sep)
+		return -1;
+	return cmd[n] - '1';
+}
+
+static void handle(int m, char *cmd)
+{
+	int n, c;
+	/* over-current protection turns the output off instead of limiting */
+	for (c = 0; c < (int)psu.channels; c++)
+		if (psu.out && psu.ocp && !cv_mode(c))
+			psu.out = 0;
+	if (!strcmp(cmd, "*IDN?"))
+		reply(m, "%s", idn);
+	else if (!strcmp(cmd, "STATUS?")) {
+		char st = (cv_mode(0) ? 0x01 : 0) |
+		          (psu.channels > 1 && cv_mode(1) ? 0x02 : 0) |
+		          (psu.ocp ? 0x20 : 0) | (psu.out ? 0x40 : 0);
+		if (raw_status)
+			transmit(m, &st, 1);
+		else
+			reply(m, "%c", st);
+	}
+	else if ((c = chan_cmd(cmd, "VSET", '?')) >= 0)
+		reply(m, "%05.2f", psu.ch[c].uset);
+	else if ((c = chan_cmd(cmd, "ISET", '?')) >= 0)
+		reply(m, "%.3f", psu.ch[c].iset);
+	else if ((c = chan_cmd(cmd, "VOUT", '?')) >= 0)
+		reply(m, "%05.2f", uout(c));
+	else if ((c = chan_cmd(cmd, "IOUT", '?')) >= 0)
+		reply(m, "%.3f", iout(c));
+	else if ((c = chan_cmd(cmd, "VSET", ':')) >= 0)
+		psu.ch[c].uset = atof(cmd + 6);
+	else if ((c = chan_cmd(cmd, "ISET", ':')) >= 0)
+		psu.ch[c].iset = atof(cmd + 6);
+	else if (!strncmp(cmd, "OUT", 3))
+		psu.out = atoi(cmd + 3) != 0;
+	else if (!strncmp(cmd, "OCP", 3))
+		psu.ocp = atoi(cmd + 3) != 0;
+	else if (!strncmp(cmd, "SAV", 3) && (n = slot_nr(cmd + 3)) >= 0)
+		memcpy(psu.slot[n], psu.ch, sizeof(psu.ch));
+	else if (!strncmp(cmd, "RCL", 3) && (n = slot_nr(cmd + 3)) >= 0)
+		memcpy(psu.ch, psu.slot[n], sizeof(psu.ch));
+	else
+		fprintf(stderr, "korad-sim: ignoring unknown command '%s'\n",
+		        cmd);
+}
+
+static int open_pty(const char **path)
+{
+	int m = posix_openpt(O_RDWR | O_NOCTTY);
+	if (m == -1 || grantpt(m) || unlockpt(m) || !(*path = ptsname(m)))
+		perror("pty"), exit(2);
+
+	/* Keep the slave open so the master does not see EOF between
+	 * consecutive clients; it also carries the shared termios. */
+	int s = open(*path, O_RDWR | O_NOCTTY);
+	struct termios t;
+	if (s == -1 || tcgetattr(s, &t))
+		perror(*path), exit(2);
+	cfmakeraw(&t);
+	if (tcsetattr(s, TCSANOW, &t))
+		perror("tcsetattr"), exit(2);
+	return m;
+}
+
+static pid_t spawn(char **argv, const char *path)
+{
+	pid_t pid = fork();
+	if (pid == -1)
+		perror("fork"), exit(2);
+	if (!pid) {
+		setenv("KORAD_DEV", path, 1);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	const char *link = NULL;
+
+	for (int opt; (opt = getopt(argc, argv, "+:c:hi:l:L:r:u")) != -1;)
+		switch (opt) {
+		case 'i': idn = optarg; break;
+		case 'l': link = optarg; break;
+		case 'L': reply_ns = atof(optarg) * 1e3; break;
+		case 'r': psu.load = atof(optarg); break;
+		case 'u': raw_status = 1; break;
+		case 'c':
+			psu.channels = atoi(optarg);
+			if (psu.channels < 1 || psu.channels > MAX_CH)
+				DIE(1,"error: invalid number of channels '%s'\n",
+				    optarg);
+			break;
+		case 'h':
+			printf("\
+usage: %s [-OPTS] [CMD [ARGS...]]\n\
+\n\
+Simulates a Korad KD3005P or, with -c 2, a KA3305P on a pseudo-terminal. If\n\
+CMD is given, it is run with KORAD_DEV pointing to the simulated device and\n\
+the simulator exits with its status, otherwise the device path is printed\n\
+and the simulator runs until killed.\n\
+\n\
+Options [defaults]:\n\
+  -h         print this help message\n\
+  -c N       simulate N channels, 2 for a KA3305P [1]\n\
+  -i IDN     reply to *IDN? with IDN [" IDN_1CH ",\n\
+             " IDN_2CH " for -c 2 or\n\
+             " IDN_RAW " for -u]\n\
+  -l PATH    create symlink PATH to the simulated device\n\
+  -L USEC    delay each reply by USEC microseconds [0]\n\
+  -r OHM     resistance of the simulated load [%g]\n\
+  -u         reply to STATUS? without line terminator as older firmware\n\
+             versions do\n\
+\n\
+Written by Franz Brauße <fb@paxle.org>\n\
+", argv[0], psu.load);
+			exit(0);
+		case ':':
+			DIE(1,"error: option '-%c' requires a parameter\n",
+			    optopt);
+		case '?':
+			DIE(1,"error: unknown option '-%c'\n",optopt);
+		}
+
+	if (!idn)
+		idn = psu.channels > 1 ? IDN_2CH
+		    : raw_status ? IDN_RAW : IDN_1CH;
+
+	const char *path;
+	int m = open_pty(&path);
+
+	if (link) {
+		unlink(link);
+		if (symlink(path, link))
+			perror(link), exit(2);
+	}
+
+	pid_t child = 0;
+	if (optind < argc)
+		child = spawn(argv + optind, path);
+	else
+		printf("%s\n", path), fflush(stdout);
+
+	char buf[256];
+	size_t len = 0;
+	int status = 0;
+	for (;;) {
+		if (child && waitpid(child, &status, WNOHANG) == child)
+			break;
+		struct pollfd p = { .fd = m, .events = POLLIN };
+		int r = poll(&p, 1, child ? 20 : -1);
+		if (r == -1 && errno != EINTR)
+			perror("poll"), exit(2);
+		if (r <= 0)
+			continue;
+		ssize_t rd = read(m, buf + len, sizeof(buf) - 1 - len);
+		if (rd < 0 && errno != EINTR && errno != EAGAIN)
+			perror("read"), exit(2);
+		if (rd <= 0)
+			continue;
+		len += rd;
+		char *s = buf, *e;
+		while ((e = memchr(s, '\n', buf + len - s))) {
+			*e = '\0';
+			if (e > s && e[-1] == '\r')
+				e[-1] = '\0';
+			if (*s)
+				handle(m, s);
+			s = e + 1;
+		}
+		len -= s - buf;
+		memmove(buf, s, len);
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+
+	if (link)
+		unlink(link);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
@@ -0,0 +1,95 @@
+/*
+ * korad-test.cpp
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+/* Checks korad.hpp against simulated devices, run by check.sh as
+ *
+ *   korad-sim -l A korad-sim -l B korad-sim -l C korad-test A B C
+ *
+ * Two voltage ramps run concurrently, one spawned by a running task, while
+ * a third device is destroyed with an operation outstanding. */
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+
+#include "korad.hpp"
+
+static int failed;
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+		             __LINE__, #c); \
+		failed = 1; \
+	} \
+} while (0)
+
+static krd::task<> ramp(krd::device &psu)
+{
+	co_await psu.set_current(1);
+	co_await psu.output(true);
+	for (double v = 1; v <= 5; v++) {
+		co_await psu.set_voltage(v);
+		/* the output follows the setpoint within a few samples */
+		double u = 0;
+		for (int n = 0; n < 50 && std::fabs(u - v) > 0.01; n++)
+			u = co_await psu.read_voltage();
+		CHECK(std::fabs(u - v) <= 0.01);
+	}
+	co_await psu.output(false);
+	unsigned st = co_await psu.status();
+	CHECK(!(st & 0x40));
+}
+
+static krd::task<> spawner(krd::executor &ex, krd::device &a,
+                           krd::device &b)
+{
+	ex.spawn(ramp(b));
+	std::string idn = co_await a.query("*IDN?");
+	CHECK(!idn.empty());
+	co_await ramp(a);
+}
+
+static krd::task<> owner(std::unique_ptr<krd::device> &c)
+{
+	co_await c->query("*IDN?");
+	c.reset();
+}
+
+static krd::task<> orphan(std::unique_ptr<krd::device> &c)
+{
+	try {
+		co_await c->read_voltage();
+		CHECK(!"operation on a destroyed device completed");
+	} catch (const std::system_error &e) {
+		CHECK(e.code().value() == ECANCELED);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 4) {
+		std::fprintf(stderr, "usage: %s DEV1 DEV2 DEV3\n", argv[0]);
+		return 1;
+	}
+	try {
+		krd::executor ex;
+		/* first, for the devices after it to move when it is gone */
+		auto c = std::make_unique<krd::device>(ex, argv[3]);
+		krd::device a(ex, argv[1]), b(ex, argv[2]);
+		ex.spawn(owner(c));
+		ex.spawn(orphan(c));
+		ex.spawn(spawner(ex, a, b));
+		ex.run();
+		CHECK(!c);
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+	return failed;
+}
@@ -17,58 +17,160 @@
 #include <errno.h>
 #include <time.h>
 
+#include "korad.h"
+#include "seq.h"
+#include "mon.h"
+#include "wdg.h"
+#include "prof.h"
+#include "cache.h"
+
 #define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
 
-static FILE *f;
-static char *line;
-static size_t sz;
-static ssize_t rd;
+/* queries are the fields and *IDN?, followed by tags of jobs not carrying
+ * a reply */
+enum { IDN = N_FIELDS, N_QUERIES, SEND = N_QUERIES, SIMUL };
+
+static const char **devs;
+static unsigned n_devs;
+static struct korad_pool *pool;
+static char (*replies)[N_QUERIES][KORAD_REPLY_MAX];
+static struct timespec *simul_t;
+static const struct korad_model **models;
+static unsigned *chans;    /* per device: mask of the selected channels */
+static int idem;           /* skip commands not changing the state */
+
+/* Waits for all commands sent to the devices to be processed. */
+static void gather(void)
+{
+	struct korad_job j;
+	for (int r; (r = korad_pool_gather(pool, &j));) {
+		if (r < 0)
+			perror("gather"), exit(2);
+		if (j.err)
+			DIE(2,"%s: error %s %s: %s\n",devs[j.dev],
+			    j.tag < N_QUERIES ? "reading output of" : "sending",
+			    j.cmd,strerror(j.err));
+		if (j.tag < N_QUERIES)
+			memcpy(replies[j.dev][j.tag], j.reply, sizeof(j.reply));
+		else if (j.tag == SIMUL)
+			simul_t[j.dev] = j.t;
+	}
+}
 
-static void * kmalloc(size_t n)
+static void send(long wait_ns, const char *fmt, ...)
 {
-	return n ? malloc(n) : NULL;
+	for (unsigned i = 0; i < n_devs; i++) {
+		va_list ap;
+		va_start(ap, fmt);
+		int r = korad_pool_vsubmit(pool, i, SEND, wait_ns, fmt, ap);
+		va_end(ap);
+		if (r)
+			perror("send"), exit(2);
+	}
 }
 
-static void kfree(void *ptr)
+static void comm(unsigned q, unsigned ch);
+
+/* Whether setting the quantity queried by q of device i to 'arg' changes
+ * it, i.e. it differs from the reply in the model's format. */
+static int changes(unsigned i, unsigned q, const char *arg)
 {
-	if (ptr)
-		free(ptr);
+	char buf[KORAD_REPLY_MAX];
+	snprintf(buf, sizeof(buf), q == VSET ? models[i]->v_fmt
+	                                     : models[i]->i_fmt, atof(arg));
+	return strcmp(buf, replies[i][q]);
 }
 
-static void * krealloc(void *ptr, size_t sz)
+/* Sends a command taking the channel and 'arg' to the selected channels of
+ * all devices, in idempotent mode only where query q replies differently. */
+static void send_ch(long wait_ns, const char *fmt, unsigned q,
+                    const char *arg)
 {
-	if (!sz) {
-		kfree(ptr);
-		return NULL;
+	for (unsigned c = 1; c <= 8; c++) {
+		if (idem) {
+			comm(q, c);
+			gather();
+		}
+		for (unsigned i = 0; i < n_devs; i++)
+			if (chans[i] & 1U << (c - 1) &&
+			    (!idem || changes(i, q, arg)) &&
+			    korad_pool_submit(pool, i, SEND, wait_ns, fmt, c,
+			                      arg))
+				perror("send"), exit(2);
 	}
-	return realloc(ptr, sz);
 }
 
-static void send(long wait_ns, const char *fmt, ...)
+/* Whether the model of device i reports status flag 'st' and it differs
+ * from 'arg'. */
+static int flag_changes(unsigned i, unsigned st, const char *arg)
+{
+	unsigned cur = korad_status(models[i], replies[i][STATUS][0], 0);
+	unsigned mask = st == KORAD_ST_OUT ? models[i]->out : models[i]->ocp;
+	return !mask || !(cur & st) != !atoi(arg);
+}
+
+/* Sends "CMD0" or "CMD1" to all devices, in idempotent mode only to those
+ * whose status flag 'st' differs or is not reported. */
+static void send_flag(long wait_ns, const char *cmd, unsigned st,
+                      const char *arg)
+{
+	for (unsigned i = 0; i < n_devs; i++) {
+		if ((!idem || flag_changes(i, st, arg)) &&
+		    korad_pool_submit(pool, i, SEND, wait_ns, "%s%s", cmd, arg))
+			perror("send"), exit(2);
+	}
+}
+
+/* Sends query q for channel ch to the devices it is selected on. */
+static void comm(unsigned q, unsigned ch)
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vfprintf(f, fmt, ap);
-	va_end(ap);
-	putc('\n', f);
-	for (struct timespec rem = { 0, wait_ns };
-	     (errno = 0, nanosleep(&rem, &rem) == -1) && errno == EINTR;);
-	if (errno)
-		perror("nanosleep"), exit(2);
+	for (unsigned i = 0; i < n_devs; i++)
+		if ((q == IDN || q == STATUS || chans[i] & 1U << (ch - 1)) &&
+		    korad_pool_submit(pool, i, q, 0, q == IDN ? "*IDN?"
+		                                            : field_queries[q],
+		                      ch))
+			perror("send"), exit(2);
 }
 
-static char * recv(const char *fmt)
+/* Removes the cached status of all devices, whose state is changed. */
+static void drop_cache(void)
 {
-	rd = getline(&line, &sz, f);
-	if (rd <= 0)
-		DIE(2,"error reading %s output\n",fmt);
-	while (rd && line[rd-1] == '\n')
-		line[--rd] = '\0';
-	return line;
+	for (unsigned i = 0; i < n_devs; i++)
+		cache_drop(devs[i]);
 }
 
-#define _comm(fmt, ...) (send(0, fmt, __VA_ARGS__), recv(fmt))
-#define comm(...) _comm(__VA_ARGS__, 0)
+/* Prefix for output concerning device i, empty if there is only one. */
+static const char * pfx(unsigned i)
+{
+	static char buf[256];
+	if (n_devs == 1)
+		return "";
+	snprintf(buf, sizeof(buf), "%s: ", devs[i]);
+	return buf;
+}
+
+/* Writes the command to all devices at once and reports the skew. */
+static void send_simul(long wait_ns, const char *cmd)
+{
+	if (korad_pool_simul(pool, SIMUL, wait_ns, "%s", cmd))
+		perror("send"), exit(2);
+	gather();
+	struct timespec t0 = simul_t[0];
+	double skew = 0;
+	for (unsigned i = 0; i < n_devs; i++)
+		if (simul_t[i].tv_sec < t0.tv_sec ||
+		    (simul_t[i].tv_sec == t0.tv_sec &&
+		     simul_t[i].tv_nsec < t0.tv_nsec))
+			t0 = simul_t[i];
+	for (unsigned i = 0; i < n_devs; i++) {
+		double d = (simul_t[i].tv_sec - t0.tv_sec) * 1e6 +
+		           (simul_t[i].tv_nsec - t0.tv_nsec) * 1e-3;
+		printf("%s%s written at +%.1f us\n", pfx(i), cmd, d);
+		if (d > skew)
+			skew = d;
+	}
+	printf("write skew: %.1f us\n", skew);
+}
 
 #define CSI	"\x1b["
 #define RED	CSI "91m"
@@ -77,17 +179,160 @@ static char * recv(const char *fmt)
 #define CYAN	CSI "96m"
 #define RESET	CSI "0m"
 
+static const char *on = "on", *off = "off", *ufmt = "", *ifmt = "", *reset = "";
+
+/* Prints the fields of channel ch of device i selected in div[]. */
+static void print_state(unsigned i, unsigned ch, const unsigned div[N_FIELDS])
+{
+	char (*r)[KORAD_REPLY_MAX] = replies[i];
+	const char *sep = "";
+	printf("%s", pfx(i));
+	if (chans[i] != 1)
+		printf("CH%u: ", ch);
+	if (div[STATUS]) {
+		unsigned char status = r[STATUS][0];
+		unsigned st = korad_status(models[i], status, ch - 1);
+		int cv_mode     =  st & KORAD_ST_CV; /* otherwise: cc mode */
+		int ocp_enabled =  st & KORAD_ST_OCP;
+		int out_enabled =  st & KORAD_ST_OUT;
+		printf("constant %s%s%s mode, ocp %s, output %s (0x%02hhx)",
+		       cv_mode ? ufmt : ifmt,
+		       cv_mode ? "voltage" : "current",
+		       reset,
+		       ocp_enabled ? on : off,
+		       out_enabled ? on : off,
+		       status);
+		sep = ", ";
+	}
+	if (div[VSET] || div[ISET]) {
+		printf("%sset to ", sep);
+		if (div[VSET])
+			printf("%s%s%sV", ufmt, r[VSET], reset);
+		if (div[VSET] && div[ISET])
+			printf(" / ");
+		if (div[ISET])
+			printf("%s%s%sA", ifmt, r[ISET], reset);
+		sep = ", ";
+	}
+	if (div[VOUT] || div[IOUT]) {
+		printf("%sactual output: ", sep);
+		if (div[VOUT])
+			printf("%s%s%sV", ufmt, r[VOUT], reset);
+		if (div[VOUT] && div[IOUT])
+			printf(" / ");
+		if (div[IOUT])
+			printf("%s%s%sA", ifmt, r[IOUT], reset);
+	}
+	printf("\n");
+}
+
+/* Prints the fields selected in div[] of the selected channels of all
+ * devices. They are taken from sc[] if 'cached' is set, otherwise queried
+ * and also stored in sc[] unless it is NULL. */
+static void print_all(const unsigned div[N_FIELDS], struct status_cache *sc,
+                      int cached)
+{
+	if (isatty(STDOUT_FILENO)) {
+		on    = GREEN   "on"  RESET;
+		off   = RED     "off" RESET;
+		ufmt  = MAGENTA;
+		ifmt  = CYAN;
+		reset = RESET;
+	}
+
+	/* replies are kept per device, so query channel by channel */
+	for (unsigned c = 1; c <= 8; c++) {
+		int any = 0;
+		for (unsigned i = 0; i < n_devs; i++)
+			any |= chans[i] & 1U << (c - 1);
+		if (!any)
+			continue;
+		if (!cached) {
+			for (enum field f = 0; f < N_FIELDS; f++)
+				if (div[f])
+					comm(f, c);
+			gather();
+		}
+
+		for (unsigned i = 0; i < n_devs; i++) {
+			if (!(chans[i] & 1U << (c - 1)))
+				continue;
+			if (cached)
+				memcpy(replies[i], sc[i].r[c - 1],
+				       sizeof(sc[i].r[c - 1]));
+			else if (sc)
+				memcpy(sc[i].r[c - 1], replies[i],
+				       sizeof(sc[i].r[c - 1]));
+			print_state(i, c, div);
+		}
+	}
+}
+
+/* Mask of the fields selected in div[]. */
+static unsigned field_mask(const unsigned div[N_FIELDS])
+{
+	unsigned fields = 0;
+	for (enum field f = 0; f < N_FIELDS; f++)
+		if (div[f])
+			fields |= 1U << f;
+	return fields;
+}
+
+static int cache_hit(struct status_cache *sc, long long ttl_ns,
+                     unsigned ch_sel, unsigned fields, int force)
+{
+	for (unsigned i = 0; i < n_devs; i++) {
+		if (cache_load(devs[i], ttl_ns, &sc[i]))
+			return 0;
+		/* errors are reported when querying the device */
+		if (!(models[i] = korad_model(sc[i].idn)) && !force)
+			return 0;
+		if (!models[i])
+			models[i] = &korad_generic;
+		unsigned all = (1U << models[i]->channels) - 1;
+		chans[i] = ch_sel & all;
+		if ((ch_sel != -1U && ch_sel & ~all) ||
+		    (sc[i].fields & fields) != fields ||
+		    (sc[i].chans & chans[i]) != chans[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* Whether the status cache holds the fields selected in div[] of the
+ * selected channels of all devices, stored less than 'ttl_ns' ago. Sets up
+ * models[] and chans[] as identifying the devices would. On a miss, sc[] is
+ * cleared to be filled by the queries. */
+static int from_cache(struct status_cache *sc, long long ttl_ns,
+                      unsigned ch_sel, const unsigned div[N_FIELDS],
+                      int force)
+{
+	if (cache_hit(sc, ttl_ns, ch_sel, field_mask(div), force))
+		return 1;
+	memset(sc, 0, n_devs * sizeof(*sc));
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	const char *dev = getenv("KORAD_DEV") ? : "/dev/ttyACM0";
+	const char *dev_args[argc];
 
 	const char *iset = NULL, *uset = NULL, *out = NULL, *ocp = NULL;
-	const char *save = NULL, *rest = NULL;
-	int print_status = 0, print_version = 0, force = 0;
+	const char *save = NULL, *rest = NULL, *seq = NULL, *trace = NULL;
+	const char *get = NULL, *put = NULL, *get_name = NULL, *put_name = NULL;
+	const char *snap = NULL, *unsnap = NULL;
+	int print_status = 0, print_version = 0, force = 0, simul = 0;
+	struct mon_opts mon = { .dv = 0.02, .di = 0.005, .key_ns = 60e9 };
+	struct wdg_opts wdg = { .timeout_ns = 1e9 };
+	const char *fields = NULL;
+	double mon_min = 0, mon_max = 0;
+	unsigned ch_sel = 1;
+	long long cache_ns = 0;
 
-	for (int opt; (opt = getopt(argc, argv, ":fD:hsI:U:S:R:o:O:v")) != -1;)
+	for (int opt; (opt = getopt(argc, argv, ":fD:hsI:U:S:R:o:O:vx:ym:n:q:T:zbk:w:c:W:L:t:C:g:p:e:E:iB:A:")) != -1;)
 		switch (opt) {
-		case 'D': dev = optarg; break;
+		case 'D': dev_args[n_devs++] = optarg; break;
 		case 'I': iset = optarg; break;
 		case 'U': uset = optarg; break;
 		case 'o': out = optarg; break;
@@ -97,28 +342,163 @@ int main(int argc, char **argv)
 		case 's': print_status = 1; break;
 		case 'v': print_version = 1; break;
 		case 'f': force = 1; break;
+		case 'i': idem = 1; break;
+		case 'x': seq = optarg; break;
+		case 't': trace = optarg; break;
+		case 'e': snap = optarg; break;
+		case 'E': unsnap = optarg; break;
+		case 'g':
+		case 'p': {
+			char *c = strrchr(optarg, ':');
+			if (!c || !c[1] || c == optarg)
+				DIE(1,"error: expected FILE:NAME, got '%s'\n",
+				    optarg);
+			*c = '\0';
+			*(opt == 'g' ? &get : &put) = optarg;
+			*(opt == 'g' ? &get_name : &put_name) = c + 1;
+			break;
+		}
+		case 'C':
+			if (!strcmp(optarg, "all")) {
+				ch_sel = -1U;
+				break;
+			}
+			ch_sel = 0;
+			for (char *c = optarg, *e;; c = e + 1) {
+				long n = strtol(c, &e, 10);
+				if (e == c || n < 1 || n > 8 || (*e && *e != ','))
+					DIE(1,"error: invalid channels '%s'\n",
+					    optarg);
+				ch_sel |= 1U << (n - 1);
+				if (!*e)
+					break;
+			}
+			break;
+		case 'y': simul = 1; break;
+		case 'A':
+			if ((cache_ns = atof(optarg) * 1e6) <= 0)
+				DIE(1,"error: invalid TTL '%s'\n",optarg);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%lf:%lf", &mon_min, &mon_max) == 1)
+				mon_max = mon_min;
+			if (!(mon_min > 0 && mon_max >= mon_min))
+				DIE(1,"error: invalid interval '%s'\n",optarg);
+			break;
+		case 'n': mon.count = atol(optarg); break;
+		case 'q': fields = optarg; break;
+		case 'z': mon.changes = 1; break;
+		case 'b': mon.binary = 1; break;
+		case 'k': mon.key_ns = atof(optarg) * 1e9; break;
+		case 'w': mon.log = optarg; break;
+		case 'c': mon.counters = optarg; break;
+		case 'B':
+			if (!strcmp(optarg, "epoll"))
+				mon.backend = KORAD_LOOP_EPOLL;
+			else if (!strcmp(optarg, "io_uring"))
+				mon.backend = KORAD_LOOP_URING;
+			else
+				DIE(1,"error: unknown event loop '%s'\n",optarg);
+			break;
+		case 'W': {
+			char *c = strrchr(optarg, ':');
+			if (c) {
+				*c = '\0';
+				wdg.timeout_ns = atof(c + 1) * 1e6;
+			}
+			wdg.heartbeat = optarg;
+			if (!*optarg || wdg.timeout_ns <= 0)
+				DIE(1,"error: invalid heartbeat '%s'\n",optarg);
+			break;
+		}
+		case 'L': {
+			char *c;
+			wdg.vmax = strtod(optarg, &c);
+			if (*c == ':')
+				wdg.imax = strtod(c + 1, &c);
+			if (*c || wdg.vmax < 0 || wdg.imax < 0)
+				DIE(1,"error: invalid limits '%s'\n",optarg);
+			break;
+		}
+		case 'T':
+			if (sscanf(optarg, "%lf:%lf", &mon.dv, &mon.di) < 1)
+				DIE(1,"error: invalid threshold '%s'\n",optarg);
+			break;
 		case 'h':
 			printf("\
 usage: %s [-OPTS]\n\
 \n\
 Options [defaults]:\n\
   -f         force usage of device even if the version does not match\n\
+  -i         idempotent mode: query the state first and send only the\n\
+             settings of -I, -U, -o and -O that change something\n\
   -s         print status\n\
+  -A MS      with -s as the only action, print the status cached by a call\n\
+             less than MS milliseconds ago without touching the devices, or\n\
+             query and cache it\n\
   -v         print version information\n\
+  -y         switch outputs of all devices simultaneously after the other\n\
+             settings and report the skew\n\
   -h         print this help message\n\
-  -D DEV     use device path DEV [%s]\n\
+  -C CHS     operate on channels CHS, a comma-separated list or 'all', of\n\
+             multi-channel devices for -I, -U, -s and -m [1]\n\
+  -D DEV     use device path DEV [%s], may be given multiple times\n\
   -I x.xxx   set maximum output current in Ampere\n\
   -U xx.xx   set maximum output voltage in Volt\n\
   -o {0|1}   turn output off or on\n\
   -O {0|1}   turn over-current protection off or on\n\
   -S {1-5}   store current U/I settings in memory slot\n\
   -R {1-5}   restore U/I settings from memory slot\n\
+  -g FILE:NAME\n\
+             read all memory slots and save them as profile NAME in FILE\n\
+  -p FILE:NAME\n\
+             store profile NAME from FILE in the memory slots of all devices\n\
+  -e FILE    save a snapshot of the state of all devices to FILE first\n\
+  -E FILE    restore the state saved by -e in FILE after the other settings,\n\
+             sending only the commands that change something\n\
+  -x FILE    execute the power sequence described in FILE, see below\n\
+  -t FILE    record all bytes exchanged with the device in FILE, or FILE.N\n\
+             for the N-th device if there are several, see korad-replay\n\
+  -m MS[:MAX_MS]\n\
+             monitor the output every MS milliseconds; if MAX_MS is given,\n\
+             sample at rates down to every MAX_MS milliseconds while steady\n\
+  -n N       stop monitoring after N samples per device\n\
+  -q FIELDS  query only the comma-separated FIELDS out of status, vset, iset,\n\
+             vout and iout; FIELD/N queries FIELD every N-th sample only\n\
+             [status,vset,iset,vout,iout for -s, status,vout,iout for -m]\n\
+  -T V[:A]   changes considered transients when monitoring [%g:%g]\n\
+  -z         output only samples that differ from the previous one\n\
+  -k SEC     with -z, output every sample after SEC seconds since the last\n\
+             such keyframe; also the length of log segments [%g]\n\
+  -b         output samples in the binary delta-encoded format of tlm.h\n\
+  -B LOOP    wait for the devices when monitoring by LOOP, one of epoll or\n\
+             io_uring [io_uring if supported, else epoll]\n\
+  -w FILE    also log changes to FILE in seekable segments, see korad-log\n\
+             and korad-analyze\n\
+  -c FILE    keep FILE updated with counters of CV/CC residency and\n\
+             transitions, OCP trips and output toggles\n\
+  -W HB[:MS] watchdog: turn the outputs off unless a heartbeat arrives at\n\
+             least every MS milliseconds [1000]; HB is a Unix datagram\n\
+             socket to create or - for any input on stdin\n\
+  -L V[:A]   watchdog: turn the outputs off when VOUT exceeds V or IOUT\n\
+             exceeds A; 0 disables a limit\n\
 \n\
 Environment variables:\n\
   KORAD_DEV  default device to use unless -D is specified\n\
 \n\
+Power sequence files contain one rail per line, '#' starts a comment:\n\
+  NAME DEV VOLTAGE CURRENT [DELAY_MS [READY [AFTER]]]\n\
+A rail is enabled DELAY_MS after all rails in the comma-separated list AFTER\n\
+are ready. READY is a condition like 'vout>=3.2' or 'iout<=0.5', optionally\n\
+followed by '@MS' to wait at most MS milliseconds [5000], or '-' for none.\n\
+On failure all rails enabled so far are turned off again.\n\
+\n\
+Profile files contain the setpoints of one channel of a memory slot per line:\n\
+  NAME SLOT CHANNEL VOLTAGE CURRENT\n\
+Outputs must be off for -g and -p, the setpoints are left unchanged.\n\
+\n\
 Written by Franz Brauße <fb@paxle.org>\n\
-", argv[0], dev);
+", argv[0], dev, mon.dv, mon.di, mon.key_ns * 1e-9);
 			exit(0);
 		case ':':
 			DIE(1,"error: option '-%c' requires a parameter\n",
@@ -127,70 +507,186 @@ Written by Franz Brauße <fb@paxle.org>\n\
 			DIE(1,"error: unknown option '-%c'\n",optopt);
 		}
 
-	int fd = open(dev, O_RDWR | O_NOCTTY);
-	if (fd == -1)
-		perror(dev), exit(1);
-
-	f = fdopen(fd, "a+");
-	if (!f)
-		perror("fdopen"), exit(2);
-
-	char *id = strdup(comm("*IDN?"));
-	if (print_version)
-		printf("device identified as: %s\n", id);
-
-	const char *toks[4];
-	toks[0] = strtok(line, " ");
-	toks[1] = strtok(NULL, " ");
-	toks[2] = strtok(NULL, " ");
-	toks[3] = strtok(NULL, " ");
-	if (!force && (strcmp(toks[0], "KORAD") || strcmp(toks[1], "KD3005P") ||
-	               strcmp(toks[2], "V6.6") || strncmp(toks[3], "SN:", 3)))
-		DIE(1,"error: device identified as '%s'. Unknown, aborting.\n",
-		    id);
-	free(id);
+	if (seq)
+		exit(run_sequence(seq, force));
+
+	if (fields && parse_fields(fields, mon.div))
+		DIE(1,"error: invalid field list '%s'\n",fields);
+	if (!fields)
+		parse_fields(print_status ? "status,vset,iset,vout,iout"
+		                          : "status,vout,iout", mon.div);
+
+	devs = dev_args;
+	if (!n_devs)
+		devs[n_devs++] = dev;
+
+	replies = calloc(n_devs, sizeof(*replies));
+	simul_t = calloc(n_devs, sizeof(*simul_t));
+	models = calloc(n_devs, sizeof(*models));
+	chans = calloc(n_devs, sizeof(*chans));
+	if (!replies || !simul_t || !models || !chans)
+		perror("init"), exit(2);
 
+	struct status_cache *sc = NULL;
+	int lock = -1;
+	if (cache_ns) {
+		if (!print_status || print_version || iset || uset || out ||
+		    ocp || save || rest || get || put || snap || unsnap ||
+		    trace || mon_min > 0 || wdg.heartbeat || wdg.vmax ||
+		    wdg.imax)
+			DIE(1,"error: -A requires -s as the only action\n");
+		if (!(sc = calloc(n_devs, sizeof(*sc))))
+			perror("init"), exit(2);
+		int hit = from_cache(sc, cache_ns, ch_sel, mon.div, force);
+		if (!hit) {
+			/* wait for a concurrent call querying the devices */
+			lock = cache_lock();
+			hit = from_cache(sc, cache_ns, ch_sel, mon.div, force);
+		}
+		if (hit) {
+			print_all(mon.div, sc, 1);
+			exit(0);
+		}
+	}
+
+	struct korad *k[n_devs];
+	for (unsigned i = 0; i < n_devs; i++)
+		if (!(k[i] = korad_open(devs[i])))
+			perror(devs[i]), exit(1);
+	for (unsigned i = 0; trace && i < n_devs; i++) {
+		char path[strlen(trace) + 12];
+		snprintf(path, sizeof(path), n_devs > 1 ? "%s.%u" : "%s", trace,
+		         i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		              0666);
+		if (fd == -1 || korad_trace(k[i], fd))
+			perror(path), exit(1);
+	}
+
+	if (!(pool = korad_pool_create(k, n_devs)))
+		perror("init"), exit(2);
+
+	comm(IDN, 0);
+	gather();
+	for (unsigned i = 0; i < n_devs; i++) {
+		const char *id = replies[i][IDN];
+		models[i] = korad_model(id);
+		if (print_version)
+			printf("%sdevice identified as: %s (%s)\n", pfx(i), id,
+			       models[i] ? models[i]->name : "unknown");
+
+		if (!models[i] && !force)
+			DIE(1,"%serror: device identified as '%s'. Unknown, "
+			    "aborting.\n", pfx(i), id);
+		if (!models[i])
+			models[i] = &korad_generic;
+		/* no jobs are in flight after gather() */
+		korad_set_model(k[i], models[i]);
+
+		unsigned all = (1U << models[i]->channels) - 1;
+		chans[i] = ch_sel & all;
+		if (ch_sel != -1U && ch_sel & ~all)
+			DIE(1,"%serror: %s has only %u channel(s)\n", pfx(i),
+			    models[i]->name, models[i]->channels);
+	}
+
+	/* cached before and while changing the state is outdated after */
+	int changing = iset || uset || out || ocp || rest || get || put ||
+	               unsnap;
+	if (changing)
+		drop_cache();
+
+	int ret;
+	if (snap && (ret = state_save(pool, devs, models, n_devs, snap)))
+		exit(ret);
+	if (get && (ret = profile_get(pool, devs, models, n_devs, get,
+	                              get_name)))
+		exit(ret);
+	if (put && (ret = profile_put(pool, devs, models, n_devs, put,
+	                              put_name)))
+		exit(ret);
+
+	if (idem && (out || ocp)) {
+		/* memory slots do not affect the output or OCP */
+		comm(STATUS, 0);
+		gather();
+	}
 	if (iset)
-		send(50e6, "ISET1:%s", iset);
+		send_ch(KORAD_PACE, "ISET%u:%s", ISET, iset);
 	if (uset)
-		send(50e6, "VSET1:%s", uset);
-	if (out)
-		send(50e6, "OUT%s", out);
+		send_ch(KORAD_PACE, "VSET%u:%s", VSET, uset);
+	if (out && !simul)
+		send_flag(KORAD_PACE, "OUT", KORAD_ST_OUT, out);
 	if (ocp)
-		send(50e6, "OCP%s", ocp);
+		send_flag(KORAD_PACE, "OCP", KORAD_ST_OCP, ocp);
 	if (save)
-		send(50e6, "SAV%s", save);
+		send(KORAD_PACE, "SAV%s", save);
 	if (rest)
-		send(50e6, "RCL%s", rest);
-
-	if (print_status) {
-		const char *on, *off, *ufmt = "", *ifmt = "", *reset = "";
-		if (isatty(STDOUT_FILENO)) {
-			on    = GREEN   "on"  RESET;
-			off   = RED     "off" RESET;
-			ufmt  = MAGENTA;
-			ifmt  = CYAN;
-			reset = RESET;
-		} else {
-			on    =         "on";
-			off   =         "off";
-		}
+		send(KORAD_PACE, "RCL%s", rest);
+	gather();
+	int any = !idem;
+	for (unsigned i = 0; out && simul && !any && i < n_devs; i++)
+		any |= flag_changes(i, KORAD_ST_OUT, out);
+	/* unlike without -y, OUT follows OCP, SAV and RCL here */
+	if (out && simul && any) {
+		char cmd[KORAD_CMD_MAX];
+		snprintf(cmd, sizeof(cmd), "OUT%s", out);
+		send_simul(KORAD_PACE, cmd);
+	}
+	if (unsnap && (ret = state_restore(pool, devs, models, n_devs, unsnap)))
+		exit(ret);
+	if (changing)
+		drop_cache();
 
-		unsigned char status = *comm("STATUS?");
-		int cv_mode     =  status & 0x01; /* otherwise: cc mode */
-		int ocp_enabled =  status & 0x20; /* undocumented */
-		int out_enabled =  status & 0x40;
-		printf("constant %s%s%s mode, ocp %s, output %s (0x%02hhx)",
-		       cv_mode ? ufmt : ifmt,
-		       cv_mode ? "voltage" : "current",
-		       reset,
-		       ocp_enabled ? on : off,
-		       out_enabled ? on : off,
-		       status);
-		printf(", set to %s%s%sV", ufmt, comm("VSET1?"), reset);
-		printf(" / %s%s%sA", ifmt, comm("ISET1?"), reset);
-		printf(", actual output: %s%s%sV", ufmt, comm("VOUT1?"), reset);
-		printf(" / %s%s%sA", ifmt, comm("IOUT1?"), reset);
-		printf("\n");
+	if (print_status)
+		print_all(mon.div, sc, 0);
+	for (unsigned i = 0; sc && i < n_devs; i++) {
+		memcpy(sc[i].idn, replies[i][IDN], sizeof(sc[i].idn));
+		/* only what was queried now */
+		sc[i].chans = chans[i];
+		sc[i].fields = field_mask(mon.div);
+		cache_store(devs[i], &sc[i]);
 	}
+	if (lock != -1)
+		close(lock);
+
+	korad_pool_close(pool);
+
+	ret = 0;
+	if (wdg.heartbeat || wdg.vmax || wdg.imax)
+	{
+		ret = run_watchdog(k, devs, n_devs, &wdg);
+		/* the outputs may have been turned off */
+		drop_cache();
+	}
+	else if (mon_min > 0) {
+		/* one monitored entry per selected channel */
+		unsigned n = 0, ch[8 * n_devs];
+		struct korad *mk[8 * n_devs];
+		const char *names[8 * n_devs];
+		char name[8 * n_devs][256];
+		for (unsigned i = 0; i < n_devs; i++)
+			for (unsigned c = 1; chans[i] >> (c - 1); c++) {
+				if (!(chans[i] & 1U << (c - 1)))
+					continue;
+				snprintf(name[n], sizeof(*name),
+				         chans[i] != 1 ? "%s:%u" : "%s",
+				         devs[i], c);
+				names[n] = name[n];
+				mk[n] = k[i];
+				ch[n++] = c;
+			}
+		mon.min_ns = mon_min * 1e6;
+		mon.max_ns = mon_max * 1e6;
+		ret = run_monitor(mk, names, ch, n, &mon);
+	}
+
+	for (unsigned i = 0; i < n_devs; i++)
+		korad_close(k[i]);
+	free(replies);
+	free(simul_t);
+	free(models);
+	free(chans);
+	free(sc);
+	return ret;
 }
@@ -0,0 +1,262 @@
+/*
+ * korad.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef KORAD_H
+#define KORAD_H
+
+#include <stdarg.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum length of a single command including the terminating newline,
+ * of a reply including the terminating NUL, number of commands that can be
+ * queued per handle and number of replies that stay valid. All buffers are
+ * part of the handle, no allocations take place after korad_open(). */
+#define KORAD_CMD_MAX		32
+#define KORAD_REPLY_MAX		64
+#define KORAD_QUEUE_MAX		64
+#define KORAD_REPLY_SLOTS	8
+
+/* Handles share no state, different handles may be used concurrently from
+ * different threads. A single handle must not. */
+struct korad;
+
+struct korad_reply {
+	unsigned id;      /* as returned by korad_submit() */
+	const char *cmd;  /* the query this is a reply to */
+	const char *data; /* reply without line terminator */
+	size_t len;       /* length of data */
+};
+
+/* Opens the device at path 'dev' or wraps an already open file descriptor,
+ * which is put into non-blocking mode and owned by the handle afterwards.
+ * Input pending before the first command is written is discarded. Return
+ * NULL and set errno on failure. */
+struct korad * korad_open(const char *dev);
+struct korad * korad_fdopen(int fd);
+void           korad_close(struct korad *k);
+
+/* Non-blocking interface.
+ *
+ * korad_submit() queues a command. Commands are written in order; the next
+ * one is written only after the reply to a preceding query has been read
+ * and at least 'wait_ns' nanoseconds after the preceding command has been
+ * written. Queries are commands ending in '?'. Returns a positive id or 0
+ * with errno set on error, EAGAIN meaning the queue is full.
+ *
+ * korad_complete() performs as much I/O as possible without blocking and
+ * returns 1 if a reply to a query has been stored in *r, 0 if no further
+ * progress can be made right now and -1 with errno set on error. The reply
+ * stays valid until KORAD_REPLY_SLOTS-1 further replies have been read. A
+ * reply longer than KORAD_REPLY_MAX-1 bytes fails with EOVERFLOW and is
+ * discarded, the handle remains usable.
+ *
+ * An event loop waits for korad_events() on korad_fd() for at most
+ * korad_timeout() milliseconds (-1: indefinitely) before calling
+ * korad_complete() again. korad_pending() is the number of queued commands
+ * including the one whose reply is outstanding. korad_written() is the
+ * CLOCK_MONOTONIC time the last command was completely written. */
+unsigned       korad_submit(struct korad *k, long wait_ns, const char *fmt,
+                            ...) __attribute__((format(printf,3,4)));
+unsigned       korad_vsubmit(struct korad *k, long wait_ns, const char *fmt,
+                             va_list ap);
+int            korad_complete(struct korad *k, struct korad_reply *r);
+int            korad_fd(const struct korad *k);
+short          korad_events(const struct korad *k);
+int            korad_timeout(const struct korad *k);
+unsigned       korad_pending(const struct korad *k);
+struct timespec korad_written(const struct korad *k);
+
+/* Blocking interface built on top of the above.
+ *
+ * korad_send() writes a command and waits 'wait_ns' nanoseconds afterwards,
+ * korad_query() returns the reply to a query or NULL with errno set. The
+ * returned string is valid as described for korad_complete(). korad_sync()
+ * waits until all queued commands have been processed; replies to queries
+ * not issued by korad_query() are discarded. */
+int            korad_send(struct korad *k, long wait_ns, const char *fmt, ...)
+               __attribute__((format(printf,3,4)));
+const char *   korad_query(struct korad *k, const char *fmt, ...)
+               __attribute__((format(printf,2,3)));
+int            korad_sync(struct korad *k);
+
+/* Protocol trace.
+ *
+ * korad_trace() starts recording all bytes written to and read from the
+ * device into the file descriptor 'fd', which is owned by the handle
+ * afterwards, or stops and closes a previous trace if 'fd' is -1. Records
+ * are buffered and written in chunks of a few KiB. The trace starts with
+ *
+ *   "KRDP" VERSION:u8 T0:varint
+ *
+ * where T0 is the CLOCK_REALTIME time tracing started in microseconds and
+ * is followed by records
+ *
+ *   DT:varint LEN_DIR:varint DATA
+ *
+ * of the LEN_DIR >> 1 bytes DATA written (LEN_DIR & 1 = 0) or read (1) DT
+ * nanoseconds after the previous record or the start. Varints are unsigned
+ * little-endian base-128. Returns 0 on success and -1 with errno set on
+ * failure. */
+#define KORAD_TRACE_MAGIC	"KRDP"
+#define KORAD_TRACE_VERSION	1
+#define KORAD_TRACE_WRITE	0
+#define KORAD_TRACE_READ	1
+
+int            korad_trace(struct korad *k, int fd);
+
+/* Device models.
+ *
+ * Known models and firmware versions are described by a table compiled into
+ * the library. korad_model() returns the entry matching the reply to *IDN?,
+ * ignoring spaces as some firmware versions omit them, or NULL if the device
+ * is unknown. korad_supported() returns whether it is known.
+ *
+ * Commands submitted with 'wait_ns' KORAD_PACE are paced by the delay the
+ * handle's model specifies for them, as returned by korad_delay(). Handles
+ * start with korad_generic, whose delays are safe for all known models, and
+ * korad_set_model() changes the model; it must not be called while commands
+ * are queued. korad_status() translates a raw status byte into the
+ * KORAD_ST_* flags of channel 'ch' (0-based).
+ *
+ * Replies are framed as the model specifies for their query, as returned by
+ * korad_framing(): a reply ends at a line terminator if 'len' is 0 and
+ * after 'len' bytes otherwise. If 'gap_ns' is positive, it also ends once no
+ * further byte arrived for that long. Bytes following a reply not ended by a
+ * line terminator are discarded until the next command is written. Rules
+ * are matched by prefix, queries without one are line-terminated. */
+#define KORAD_PACE	(-1L)
+
+#define KORAD_ST_CV	0x01   /* constant voltage, otherwise current */
+#define KORAD_ST_OCP	0x20   /* over-current protection enabled */
+#define KORAD_ST_OUT	0x40   /* output on */
+
+struct korad_framing {
+	unsigned len;             /* reply length, 0: up to a line terminator */
+	long gap_ns;              /* > 0: reply ends after this idle time */
+};
+
+struct korad_frame_rule {
+	const char *cmd;          /* prefix of the query, NULL: end of rules */
+	struct korad_framing f;
+};
+
+struct korad_model {
+	const char *idn;          /* prefix of *IDN? without spaces */
+	const char *name;
+	unsigned channels;
+	/* delays after VSET/ISET, OUT, OCP/OVP and SAV/RCL commands */
+	long set_ns, out_ns, prot_ns, mem_ns;
+	/* formats of voltages and currents in replies and commands */
+	const char *v_fmt, *i_fmt;
+	/* status bits: CV mode per channel, output on, OCP enabled; 0 if not
+	 * reported */
+	unsigned char cv[2], out, ocp;
+	/* framing of replies deviating from line-terminated ones, NULL: none */
+	const struct korad_frame_rule *frames;
+};
+
+extern const struct korad_model korad_generic;
+
+const struct korad_model * korad_model(const char *idn);
+int            korad_supported(const char *idn);
+void           korad_set_model(struct korad *k, const struct korad_model *m);
+const struct korad_model * korad_get_model(const struct korad *k);
+long           korad_delay(const struct korad_model *m, const char *cmd);
+struct korad_framing korad_framing(const struct korad_model *m,
+                                   const char *cmd);
+unsigned       korad_status(const struct korad_model *m, unsigned raw,
+                            unsigned ch);
+
+/* Worker pool servicing each device handle by a dedicated thread.
+ *
+ * The pool does not take ownership of the handles, which must not be used
+ * otherwise while the pool exists. Jobs for the same device are executed in
+ * submission order by korad_send() or korad_query(), those for different
+ * devices concurrently. The thread calling korad_pool_submit() and
+ * korad_pool_gather() is the coordinator, only one such thread may exist per
+ * pool. Each device has at most KORAD_POOL_QUEUE jobs in flight.
+ *
+ * korad_pool_submit() and korad_pool_broadcast() return 0 on success and -1
+ * with errno set on failure. korad_pool_gather() blocks until a job has
+ * completed and returns 1 after storing it in *j, 0 if no jobs are in flight
+ * and -1 with errno set on error.
+ *
+ * korad_pool_simul() is like korad_pool_broadcast(), but the workers wait for
+ * each other after finishing their preceding jobs, including the pacing
+ * delays, and then write the command at the same time. The write times are
+ * reported in the jobs' 't' member. */
+#define KORAD_POOL_QUEUE	64
+
+struct korad_pool;
+
+struct korad_job {
+	unsigned dev;                  /* index of the device handle */
+	unsigned tag;                  /* user-defined */
+	long wait_ns;
+	char cmd[KORAD_CMD_MAX];
+	char reply[KORAD_REPLY_MAX];   /* reply if cmd is a query */
+	int err;                       /* errno value, 0 on success */
+	int simul;                     /* submitted by korad_pool_simul() */
+	struct timespec t;             /* time cmd was written */
+};
+
+struct korad_pool * korad_pool_create(struct korad *const *k, unsigned n);
+void                korad_pool_close(struct korad_pool *p);
+int                 korad_pool_submit(struct korad_pool *p, unsigned dev,
+                                      unsigned tag, long wait_ns,
+                                      const char *fmt, ...)
+                    __attribute__((format(printf,5,6)));
+int                 korad_pool_vsubmit(struct korad_pool *p, unsigned dev,
+                                       unsigned tag, long wait_ns,
+                                       const char *fmt, va_list ap);
+int                 korad_pool_broadcast(struct korad_pool *p, unsigned tag,
+                                         long wait_ns, const char *fmt, ...)
+                    __attribute__((format(printf,4,5)));
+int                 korad_pool_simul(struct korad_pool *p, unsigned tag,
+                                     long wait_ns, const char *fmt, ...)
+                    __attribute__((format(printf,4,5)));
+int                 korad_pool_gather(struct korad_pool *p,
+                                      struct korad_job *j);
+
+/* Event loop for many handles.
+ *
+ * A loop waits for progress on any number of handles at once, by epoll or by
+ * io_uring, where re-arming all handles and waiting take a single system
+ * call. korad_loop_create() uses the given backend, or io_uring if the
+ * kernel supports it and epoll otherwise if 'backend' is 0. It returns NULL
+ * with errno set on failure. korad_loop_add() registers a handle, which must
+ * stay open until korad_loop_close(), and returns its index or -1 with errno
+ * set.
+ *
+ * korad_loop_wait() waits up to 'timeout_ms' milliseconds (-1: indefinitely),
+ * but at most until the first pacing delay of a handle has elapsed, for
+ * korad_complete() to be able to make progress on any handle. It stores the
+ * indices of up to 'max' such handles in ready[] and returns their number,
+ * which is 0 on timeout or if interrupted by a signal, or -1 with errno set
+ * on error. Handles not stored are reported by the next call. */
+#define KORAD_LOOP_EPOLL	1
+#define KORAD_LOOP_URING	2
+
+struct korad_loop;
+
+struct korad_loop * korad_loop_create(int backend);
+void                korad_loop_close(struct korad_loop *l);
+int                 korad_loop_backend(const struct korad_loop *l);
+int                 korad_loop_add(struct korad_loop *l, struct korad *k);
+int                 korad_loop_wait(struct korad_loop *l, int timeout_ms,
+                                    unsigned *ready, unsigned max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * korad.hpp
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef KORAD_HPP
+#define KORAD_HPP
+
+/* Header-only C++20 coroutine interface on top of the non-blocking C API.
+ *
+ * A krd::executor drives any number of krd::device handles from a single
+ * thread with epoll. Operations on a device are awaitable; they are
+ * submitted when awaited and complete in submission order, commands once
+ * written and queries once their reply has been read. Coroutines are
+ * krd::task<T>, which start when awaited or, for top-level tasks, when the
+ * executor runs:
+ *
+ *   krd::task<> ramp(krd::device &psu)
+ *   {
+ *       for (double v = 1; v <= 5; v++) {
+ *           co_await psu.set_voltage(v);
+ *           double i = co_await psu.read_current();
+ *           ...
+ *       }
+ *   }
+ *
+ *   krd::executor ex;
+ *   krd::device a(ex, "/dev/ttyACM0"), b(ex, "/dev/ttyACM1");
+ *   ex.spawn(ramp(a));
+ *   ex.spawn(ramp(b));
+ *   ex.run();
+ *
+ * Errors are reported as std::system_error thrown from co_await, including
+ * EAGAIN if more than KORAD_QUEUE_MAX operations are outstanding on a device.
+ * After an I/O error all outstanding and further operations on the device
+ * fail. Operations outstanding when a device is destroyed fail with
+ * ECANCELED. Nothing here is thread-safe. */
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "korad.h"
+
+namespace krd {
+
+class executor;
+class device;
+
+namespace detail {
+
+inline long long now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+struct promise_base {
+	std::coroutine_handle<> cont; /* awaiting coroutine, none if top-level */
+	std::exception_ptr exc;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			auto c = h.promise().cont;
+			return c ? c : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() { exc = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	void return_value(T v) { value.emplace(std::move(v)); }
+	T result()
+	{
+		if (exc)
+			std::rethrow_exception(exc);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	void return_void() {}
+	void result()
+	{
+		if (exc)
+			std::rethrow_exception(exc);
+	}
+};
+
+/* state of an operation queued on a device */
+struct op_base {
+	device &d;
+	std::string cmd;
+	long wait_ns;
+	unsigned id = 0;   /* as returned by korad_submit() */
+	unsigned seq = 0;  /* number of commands submitted to d up to this */
+	int err = 0;
+	std::string reply;
+	std::coroutine_handle<> h;
+
+	op_base(device &d, std::string cmd, long wait_ns)
+	: d(d), cmd(std::move(cmd)), wait_ns(wait_ns) {}
+
+	bool await_ready() noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h);
+
+	void check() const
+	{
+		if (err)
+			throw std::system_error(err, std::generic_category(),
+			                        cmd);
+	}
+};
+
+} // namespace detail
+
+/* Lazily started coroutine returning T. */
+template <typename T = void>
+class task {
+public:
+	struct promise_type : detail::promise<T> {
+		task get_return_object()
+		{
+			return task(handle::from_promise(*this));
+		}
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	task(task &&o) noexcept : h(std::exchange(o.h, {})) {}
+	task & operator=(task &&o) noexcept
+	{
+		std::swap(h, o.h);
+		return *this;
+	}
+	~task() { if (h) h.destroy(); }
+
+	bool await_ready() noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c)
+	{
+		h.promise().cont = c;
+		return h;
+	}
+	T await_resume() { return h.promise().result(); }
+
+private:
+	friend class executor;
+	explicit task(handle h) : h(h) {}
+	handle h;
+};
+
+/* Single-threaded event loop servicing devices and timers. */
+class executor {
+public:
+	executor() : epfd(epoll_create1(EPOLL_CLOEXEC))
+	{
+		if (epfd == -1)
+			throw std::system_error(errno, std::generic_category(),
+			                        "epoll_create1");
+	}
+	executor(const executor &) = delete;
+	executor & operator=(const executor &) = delete;
+	~executor() { close(epfd); }
+
+	/* Adds a top-level task, started by run(), also if it is running. */
+	void spawn(task<> t) { fresh.push_back(std::move(t)); }
+
+	/* Runs until all spawned tasks have completed. The exception of the
+	 * first task failing is rethrown, leaving the others suspended. */
+	void run();
+
+	/* Awaitable suspending the coroutine for 'ns' nanoseconds. */
+	auto sleep(long long ns)
+	{
+		struct sleeper {
+			executor &ex;
+			long long until;
+			bool await_ready() noexcept
+			{
+				return until <= detail::now_ns();
+			}
+			void await_suspend(std::coroutine_handle<> h)
+			{
+				ex.timers.emplace(until, h);
+			}
+			void await_resume() noexcept {}
+		};
+		return sleeper{*this, detail::now_ns() + ns};
+	}
+
+private:
+	friend class device;
+
+	int epfd;
+	std::vector<device *> devs;
+	std::vector<task<>> tasks;
+	std::deque<task<>> fresh;  /* spawned, not started yet */
+	std::multimap<long long, std::coroutine_handle<>> timers;
+
+	void add(device *d, int fd);
+	void remove(device *d, int fd);
+};
+
+/* A device driven by an executor. */
+class device {
+public:
+	/* Awaitable operation, co_await yields T: nothing for commands, the
+	 * reply for query(), the value for the read_*() functions and the raw
+	 * status byte for status(). */
+	template <typename T>
+	struct op : detail::op_base {
+		using op_base::op_base;
+
+		T await_resume()
+		{
+			check();
+			if constexpr (std::is_same_v<T, std::string>)
+				return std::move(reply);
+			else if constexpr (std::is_same_v<T, double>)
+				return std::strtod(reply.c_str(), nullptr);
+			else if constexpr (std::is_same_v<T, unsigned>)
+				return static_cast<unsigned char>(reply[0]);
+		}
+	};
+
+	/* Opens the device at 'path', throws std::system_error on failure. */
+	device(executor &ex, const char *path) : ex(ex), k(korad_open(path))
+	{
+		if (!k)
+			throw std::system_error(errno, std::generic_category(),
+			                        path);
+		ex.add(this, korad_fd(k));
+	}
+	device(const device &) = delete;
+	device & operator=(const device &) = delete;
+	~device()
+	{
+		/* resumed by the executor, they do not refer to *this then */
+		for (auto *o : ops) {
+			o->err = ECANCELED;
+			ex.timers.emplace(0, o->h);
+		}
+		ex.remove(this, korad_fd(k));
+		korad_close(k);
+	}
+
+	struct korad * handle() const { return k; }
+	const struct korad_model * model() const { return korad_get_model(k); }
+	/* must not be called while operations are outstanding */
+	void set_model(const struct korad_model *m) { korad_set_model(k, m); }
+
+	op<void> send(std::string cmd, long wait_ns = KORAD_PACE)
+	{
+		return { *this, std::move(cmd), wait_ns };
+	}
+	op<std::string> query(std::string cmd)
+	{
+		return { *this, std::move(cmd), 0 };
+	}
+
+	op<void> set_voltage(double v, unsigned ch = 1)
+	{
+		return { *this, fmt("VSET", ch, model()->v_fmt, v),
+		         KORAD_PACE };
+	}
+	op<void> set_current(double a, unsigned ch = 1)
+	{
+		return { *this, fmt("ISET", ch, model()->i_fmt, a),
+		         KORAD_PACE };
+	}
+	op<void> output(bool on) { return send(on ? "OUT1" : "OUT0"); }
+	op<void> ocp(bool on) { return send(on ? "OCP1" : "OCP0"); }
+
+	op<double> read_voltage(unsigned ch = 1)
+	{
+		return { *this, "VOUT" + std::to_string(ch) + "?", 0 };
+	}
+	op<double> read_current(unsigned ch = 1)
+	{
+		return { *this, "IOUT" + std::to_string(ch) + "?", 0 };
+	}
+	op<unsigned> status() { return { *this, "STATUS?", 0 }; }
+
+private:
+	friend class executor;
+	friend struct detail::op_base;
+
+	executor &ex;
+	struct korad *k;
+	std::deque<detail::op_base *> ops; /* outstanding, in order */
+	unsigned submitted = 0;
+	int err = 0;                       /* of the device, 0 if usable */
+	short armed = 0;                   /* events registered with epoll */
+
+	static std::string fmt(const char *cmd, unsigned ch, const char *f,
+	                       double x)
+	{
+		char buf[KORAD_CMD_MAX];
+		int n = std::snprintf(buf, sizeof(buf), "%s%u:", cmd, ch);
+		std::snprintf(buf + n, sizeof(buf) - n, f, x);
+		return buf;
+	}
+
+	bool submit(detail::op_base *o)
+	{
+		if ((o->err = err))
+			return false;
+		if (!(o->id = korad_submit(k, o->wait_ns, "%s",
+		                           o->cmd.c_str()))) {
+			o->err = errno;
+			return false;
+		}
+		o->seq = ++submitted;
+		ops.push_back(o);
+		return true;
+	}
+
+	/* Performs I/O and resumes the operations completed. */
+	void poll()
+	{
+		std::vector<detail::op_base *> done;
+		korad_reply r;
+		int c;
+		while ((c = korad_complete(k, &r)) > 0)
+			for (auto *o : ops)
+				if (o->id == r.id) {
+					o->reply.assign(r.data, r.len);
+					break;
+				}
+		if (c < 0) {
+			err = errno;
+			for (auto *o : ops)
+				o->err = err;
+			done.assign(ops.begin(), ops.end());
+			ops.clear();
+		} else {
+			unsigned fin = submitted - korad_pending(k);
+			for (; !ops.empty() && ops.front()->seq <= fin;
+			     ops.pop_front())
+				done.push_back(ops.front());
+		}
+		/* this device may be gone after resuming */
+		for (auto *o : done)
+			o->h.resume();
+	}
+
+	/* Registers the events awaited with epoll, returns the timeout. */
+	int arm()
+	{
+		short ev = err ? 0 : korad_events(k);
+		if (ev != armed) {
+			struct epoll_event e = {};
+			if (ev & POLLIN)
+				e.events |= EPOLLIN;
+			if (ev & POLLOUT)
+				e.events |= EPOLLOUT;
+			e.data.ptr = this;
+			if (epoll_ctl(ex.epfd, EPOLL_CTL_MOD, korad_fd(k), &e))
+				throw std::system_error(errno,
+				                        std::generic_category(),
+				                        "epoll_ctl");
+			armed = ev;
+		}
+		return err ? -1 : korad_timeout(k);
+	}
+};
+
+inline bool detail::op_base::await_suspend(std::coroutine_handle<> h)
+{
+	this->h = h;
+	return d.submit(this);
+}
+
+inline void executor::add(device *d, int fd)
+{
+	struct epoll_event e = {};
+	e.data.ptr = d;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e))
+		throw std::system_error(errno, std::generic_category(),
+		                        "epoll_ctl");
+	devs.push_back(d);
+}
+
+inline void executor::remove(device *d, int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+	/* cleared only, run() may be polling the devices */
+	for (auto &p : devs)
+		if (p == d)
+			p = nullptr;
+}
+
+inline void executor::run()
+{
+	for (;;) {
+		/* tasks may spawn others, which only go to fresh */
+		while (!fresh.empty()) {
+			tasks.push_back(std::move(fresh.front()));
+			fresh.pop_front();
+			tasks.back().h.resume();
+		}
+
+		long long t = detail::now_ns();
+		while (!timers.empty() && timers.begin()->first <= t) {
+			auto h = timers.begin()->second;
+			timers.erase(timers.begin());
+			h.resume();
+		}
+		/* by index, devices may come and go while resuming */
+		for (size_t i = 0; i < devs.size(); i++)
+			if (devs[i])
+				devs[i]->poll();
+		std::erase(devs, nullptr);
+
+		bool running = false;
+		for (auto it = tasks.begin(); it != tasks.end();)
+			if (!it->h.done()) {
+				running = true;
+				++it;
+			} else if (it->h.promise().exc) {
+				auto exc = it->h.promise().exc;
+				tasks.erase(it);
+				std::rethrow_exception(exc);
+			} else
+				it = tasks.erase(it);
+		if (!fresh.empty())
+			continue;
+		if (!running)
+			break;
+
+		int to = -1;
+		bool busy = !timers.empty();
+		for (auto *d : devs) {
+			int dt = d->arm();
+			if (dt >= 0 && (to < 0 || dt < to))
+				to = dt;
+			busy |= !d->ops.empty();
+		}
+		if (!busy)
+			throw std::logic_error("krd::executor: tasks wait on "
+			                       "nothing");
+		if (!timers.empty()) {
+			long long d = timers.begin()->first - detail::now_ns();
+			int dt = d > 0 ? (d + 999999) / 1000000 : 0;
+			if (to < 0 || dt < to)
+				to = dt;
+		}
+		struct epoll_event ev[16];
+		if (epoll_wait(epfd, ev, 16, to) == -1 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(),
+			                        "epoll_wait");
+	}
+}
+
+} // namespace krd
+
+#endif
@@ -0,0 +1,540 @@
+/*
+ * libkorad.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include "korad.h"
+
+struct korad_cmd {
+	unsigned id;
+	long wait_ns;
+	struct korad_framing f; /* of the reply if a query */
+	size_t len;
+	char text[KORAD_CMD_MAX];
+};
+
+/* Replies are read into a ring buffer and returned from there in place, the
+ * terminator is overwritten by NUL. A reply never wraps around the end of the
+ * buffer: if less than KORAD_REPLY_MAX bytes are left when the next one
+ * starts, the bytes of it already read are moved to the front. The buffer
+ * holds the KORAD_REPLY_SLOTS replies that stay valid, at most one such gap
+ * at the end and the reply being received. Positions are absolute. */
+#define RX_BUF		1024
+
+_Static_assert(RX_BUF >= (KORAD_REPLY_SLOTS + 2) * KORAD_REPLY_MAX,
+               "receive buffer too small");
+
+struct korad {
+	int fd;
+	unsigned next_id;
+	/* ring of queued commands, the head is being written or awaits its
+	 * reply */
+	struct korad_cmd q[KORAD_QUEUE_MAX];
+	size_t q_head, q_len;
+	size_t wr;            /* bytes of the head command written so far */
+	int awaiting;         /* head command is a query, reply outstanding */
+	struct timespec ready; /* earliest time the next command may be written */
+	struct timespec written; /* time the last command was written */
+	char rx[RX_BUF];
+	size_t rx_head;       /* start of the reply being received */
+	size_t rx_tail;       /* end of the bytes received */
+	struct timespec rx_t; /* time the last bytes were received */
+	int drain;            /* discard input before the next write */
+	int lf;               /* a line terminator may follow late */
+	char cmd[KORAD_REPLY_SLOTS][KORAD_CMD_MAX]; /* of the replies */
+	unsigned cur;         /* entry of cmd[] for the next reply */
+	const struct korad_model *model;
+	/* protocol trace, buffered and written in chunks */
+	int trace_fd;         /* -1: not tracing */
+	unsigned char *trace_buf;
+	size_t trace_len;
+	struct timespec trace_t; /* time of the previous trace record */
+};
+
+#define TRACE_BUF	4096
+
+static void * kmalloc(size_t n)
+{
+	return n ? malloc(n) : NULL;
+}
+
+static void kfree(void *ptr)
+{
+	if (ptr)
+		free(ptr);
+}
+
+static struct timespec ts_add_ns(struct timespec t, long ns)
+{
+	t.tv_sec += ns / 1000000000L;
+	t.tv_nsec += ns % 1000000000L;
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
+	}
+	return t;
+}
+
+static long ts_diff_ns(struct timespec a, struct timespec b)
+{
+	return (a.tv_sec - b.tv_sec) * 1000000000L + (a.tv_nsec - b.tv_nsec);
+}
+
+static struct timespec now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t;
+}
+
+struct korad * korad_fdopen(int fd)
+{
+	int fl = fcntl(fd, F_GETFL);
+	if (fl == -1 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1)
+		return NULL;
+	struct korad *k = kmalloc(sizeof(*k));
+	if (!k)
+		return NULL;
+	memset(k, 0, sizeof(*k));
+	k->fd = fd;
+	k->next_id = 1;
+	k->trace_fd = -1;
+	k->model = &korad_generic;
+	/* bytes left by a previous user of the device, e.g. the terminator of
+	 * a reply framed without it, must not start the first reply */
+	k->drain = k->lf = 1;
+	return k;
+}
+
+struct korad * korad_open(const char *dev)
+{
+	int fd = open(dev, O_RDWR | O_NOCTTY);
+	if (fd == -1)
+		return NULL;
+	struct korad *k = korad_fdopen(fd);
+	if (!k) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return k;
+}
+
+static size_t put_varint(unsigned char *p, unsigned long long v)
+{
+	size_t n = 0;
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = v | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+static int trace_flush(struct korad *k)
+{
+	for (size_t off = 0; off < k->trace_len;) {
+		ssize_t wr = write(k->trace_fd, k->trace_buf + off,
+		                   k->trace_len - off);
+		if (wr < 0 && errno != EINTR)
+			return -1;
+		off += wr > 0 ? wr : 0;
+	}
+	k->trace_len = 0;
+	return 0;
+}
+
+/* Appends a record of 'len' bytes transferred in direction 'dir'. Tracing
+ * stops on errors. */
+static void trace(struct korad *k, unsigned dir, const void *data, size_t len)
+{
+	if (k->trace_fd == -1)
+		return;
+	struct timespec t = now();
+	unsigned char hdr[2 * 10];
+	size_t n = put_varint(hdr, ts_diff_ns(t, k->trace_t));
+	n += put_varint(hdr + n, (unsigned long long)len << 1 | dir);
+	k->trace_t = t;
+	if (k->trace_len + n + len > TRACE_BUF && trace_flush(k))
+		goto err;
+	if (n + len > TRACE_BUF) {
+		/* cannot happen for lengths bounded by KORAD_REPLY_MAX */
+		errno = EMSGSIZE;
+		goto err;
+	}
+	memcpy(k->trace_buf + k->trace_len, hdr, n);
+	memcpy(k->trace_buf + k->trace_len + n, data, len);
+	k->trace_len += n + len;
+	return;
+err:
+	korad_trace(k, -1);
+}
+
+int korad_trace(struct korad *k, int fd)
+{
+	if (k->trace_fd != -1) {
+		int r = trace_flush(k);
+		close(k->trace_fd);
+		k->trace_fd = -1;
+		kfree(k->trace_buf);
+		k->trace_buf = NULL;
+		k->trace_len = 0;
+		if (r)
+			return -1;
+	}
+	if (fd == -1)
+		return 0;
+	if (!(k->trace_buf = kmalloc(TRACE_BUF)))
+		return -1;
+	struct timespec rt;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	k->trace_fd = fd;
+	memcpy(k->trace_buf, KORAD_TRACE_MAGIC, 4);
+	k->trace_buf[4] = KORAD_TRACE_VERSION;
+	k->trace_len = 5 + put_varint(k->trace_buf + 5, rt.tv_sec * 1000000ULL
+	                                                + rt.tv_nsec / 1000);
+	k->trace_t = now();
+	return 0;
+}
+
+void korad_close(struct korad *k)
+{
+	if (!k)
+		return;
+	korad_trace(k, -1);
+	close(k->fd);
+	kfree(k);
+}
+
+int korad_fd(const struct korad *k)
+{
+	return k->fd;
+}
+
+unsigned korad_pending(const struct korad *k)
+{
+	return k->q_len;
+}
+
+struct timespec korad_written(const struct korad *k)
+{
+	return k->written;
+}
+
+void korad_set_model(struct korad *k, const struct korad_model *m)
+{
+	k->model = m;
+}
+
+const struct korad_model * korad_get_model(const struct korad *k)
+{
+	return k->model;
+}
+
+static struct korad_cmd * head(struct korad *k)
+{
+	return &k->q[k->q_head];
+}
+
+static void pop(struct korad *k)
+{
+	k->q_head = (k->q_head + 1) % KORAD_QUEUE_MAX;
+	k->q_len--;
+}
+
+static int is_query(const struct korad_cmd *c)
+{
+	return c->len >= 2 && c->text[c->len-2] == '?';
+}
+
+/* Whether the head command may be written right now. */
+static int writable(const struct korad *k, struct timespec t)
+{
+	return k->q_len && !k->awaiting &&
+	       (k->wr || ts_diff_ns(k->ready, t) <= 0);
+}
+
+/* Time left until the reply being received ends by its idle gap, -1 if it
+ * cannot. */
+static long gap_left(const struct korad *k, struct timespec t)
+{
+	const struct korad_cmd *c = &k->q[k->q_head];
+	if (!k->awaiting || c->f.gap_ns <= 0 || k->rx_tail == k->rx_head)
+		return -1;
+	long ns = c->f.gap_ns - ts_diff_ns(t, k->rx_t);
+	return ns > 0 ? ns : 0;
+}
+
+short korad_events(const struct korad *k)
+{
+	if (k->awaiting)
+		return POLLIN;
+	return writable(k, now()) ? POLLOUT : 0;
+}
+
+int korad_timeout(const struct korad *k)
+{
+	long ns;
+	if (k->awaiting) {
+		if ((ns = gap_left(k, now())) < 0)
+			return -1;
+	} else if (!k->q_len || k->wr)
+		return -1;
+	else
+		ns = ts_diff_ns(k->ready, now());
+	return ns <= 0 ? 0 : (ns + 999999) / 1000000;
+}
+
+unsigned korad_vsubmit(struct korad *k, long wait_ns, const char *fmt,
+                       va_list ap)
+{
+	if (k->q_len == KORAD_QUEUE_MAX) {
+		errno = EAGAIN;
+		return 0;
+	}
+	struct korad_cmd *c = &k->q[(k->q_head + k->q_len) % KORAD_QUEUE_MAX];
+	int n = vsnprintf(c->text, sizeof(c->text), fmt, ap);
+	if (n < 0)
+		return 0;
+	if ((size_t)n + 1 >= sizeof(c->text)) {
+		errno = EMSGSIZE;
+		return 0;
+	}
+	c->text[n++] = '\n';
+	c->len = n;
+	c->wait_ns = wait_ns == KORAD_PACE ? korad_delay(k->model, c->text)
+	                                   : wait_ns;
+	c->f = korad_framing(k->model, c->text);
+	c->id = k->next_id++ ? : k->next_id++;
+	k->q_len++;
+	return c->id;
+}
+
+unsigned korad_submit(struct korad *k, long wait_ns, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	unsigned id = korad_vsubmit(k, wait_ns, fmt, ap);
+	va_end(ap);
+	return id;
+}
+
+/* Reads up to 'n' bytes into the buffer at the end of the received ones.
+ * Returns 0 on success and -1 with errno set on failure, EAGAIN if nothing
+ * could be read. */
+static int receive(struct korad *k, size_t n)
+{
+	for (;;) {
+		ssize_t rd = read(k->fd, k->rx + k->rx_tail % RX_BUF, n);
+		if (rd > 0) {
+			trace(k, KORAD_TRACE_READ, k->rx + k->rx_tail % RX_BUF,
+			      rd);
+			k->rx_tail += rd;
+			k->rx_t = now();
+			return 0;
+		}
+		if (!rd) {
+			errno = EIO;
+			return -1;
+		}
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+/* Receives the reply framed as 'f' and returns its length. The number of
+ * bytes it occupies in the buffer is stored in *used. Returns -1 with errno
+ * set if it is incomplete, EAGAIN if more bytes may arrive. */
+static ssize_t fill(struct korad *k, const struct korad_framing *f,
+                    size_t *used)
+{
+	for (;;) {
+		char *s = k->rx + k->rx_head % RX_BUF, *nl;
+		size_t n = k->rx_tail - k->rx_head;
+		/* of the last reply, if it was not ended by it */
+		if (!f->len && n && k->lf) {
+			k->lf = 0;
+			if (*s == '\n') {
+				k->rx_head++;
+				continue;
+			}
+		}
+		if (f->len && n >= f->len) {
+			*used = n;
+			return f->len;
+		}
+		if (!f->len && (nl = memchr(s, '\n', n))) {
+			*used = nl - s + 1;
+			return nl - s;
+		}
+		if (n == KORAD_REPLY_MAX - 1 || f->len >= KORAD_REPLY_MAX) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		if (receive(k, f->len ? f->len - n : KORAD_REPLY_MAX - 1 - n))
+			return -1;
+	}
+}
+
+/* Discards the bytes received after a reply not ended by a line
+ * terminator. */
+static int drain(struct korad *k)
+{
+	while (!receive(k, KORAD_REPLY_MAX - 1))
+		k->rx_tail = k->rx_head;
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	k->drain = 0;
+	return 0;
+}
+
+/* Returns the reply of length 'len' occupying 'used' bytes in *r and
+ * starts the next one. */
+static void finish(struct korad *k, size_t len, size_t used,
+                   struct korad_reply *r)
+{
+	struct korad_cmd *c = head(k);
+	char *s = k->rx + k->rx_head % RX_BUF;
+	char *cmd = k->cmd[k->cur];
+	k->cur = (k->cur + 1) % KORAD_REPLY_SLOTS;
+	memcpy(cmd, c->text, c->len - 1);
+	cmd[c->len - 1] = '\0';
+	s[len] = '\0';
+	r->id = c->id;
+	r->cmd = cmd;
+	r->data = s;
+	r->len = len;
+
+	k->rx_head += used;
+	if (c->f.len || c->f.gap_ns > 0) {
+		k->rx_tail = k->rx_head;
+		k->drain = k->lf = 1;
+	}
+	size_t left = RX_BUF - k->rx_head % RX_BUF;
+	if (left < KORAD_REPLY_MAX) {
+		memmove(k->rx, k->rx + k->rx_head % RX_BUF,
+		        k->rx_tail - k->rx_head);
+		k->rx_head += left;
+		k->rx_tail += left;
+	}
+	k->awaiting = 0;
+	pop(k);
+}
+
+int korad_complete(struct korad *k, struct korad_reply *r)
+{
+	for (;;) {
+		if (k->awaiting) {
+			size_t used;
+			ssize_t len = fill(k, &head(k)->f, &used);
+			if (len < 0 && errno == EOVERFLOW) {
+				/* skip the rest of the reply, keep the handle
+				 * usable */
+				k->rx_tail = k->rx_head;
+				k->drain = k->lf = 1;
+				k->awaiting = 0;
+				pop(k);
+				errno = EOVERFLOW;
+				return -1;
+			}
+			if (len < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return -1;
+				if (gap_left(k, now()))
+					return 0;
+				len = used = k->rx_tail - k->rx_head;
+			}
+			finish(k, len, used, r);
+			return 1;
+		}
+		if (!writable(k, now()))
+			return 0;
+		if (!k->wr && k->drain && drain(k))
+			return -1;
+		struct korad_cmd *c = head(k);
+		ssize_t wr = write(k->fd, c->text + k->wr, c->len - k->wr);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		trace(k, KORAD_TRACE_WRITE, c->text + k->wr, wr);
+		if ((k->wr += wr) < c->len)
+			continue;
+		k->wr = 0;
+		k->written = now();
+		k->ready = ts_add_ns(k->written, c->wait_ns);
+		if (is_query(c))
+			k->awaiting = 1;
+		else
+			pop(k);
+	}
+}
+
+/* Blocks until korad_complete() can make progress or, if no commands are
+ * pending, until the pacing delay of the last command has elapsed. */
+static int wait_io(struct korad *k)
+{
+	struct timespec t = now(), *tp = NULL, rem = { 0, 0 };
+	struct pollfd p = { .fd = k->fd, .events = korad_events(k) };
+	long ns = k->awaiting ? gap_left(k, t)
+	        : p.events ? -1 : ts_diff_ns(k->ready, t);
+	if (ns >= 0 || (!p.events && !k->awaiting)) {
+		if (ns > 0)
+			rem = ts_add_ns(rem, ns);
+		tp = &rem;
+	}
+	if (ppoll(&p, p.events ? 1 : 0, tp, NULL) == -1 && errno != EINTR)
+		return -1;
+	return 0;
+}
+
+int korad_sync(struct korad *k)
+{
+	struct korad_reply r;
+	for (int c; k->q_len;)
+		if ((c = korad_complete(k, &r)) < 0 || (!c && wait_io(k)))
+			return -1;
+	while (ts_diff_ns(k->ready, now()) > 0)
+		if (wait_io(k))
+			return -1;
+	return 0;
+}
+
+int korad_send(struct korad *k, long wait_ns, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	unsigned id = korad_vsubmit(k, wait_ns, fmt, ap);
+	va_end(ap);
+	return id ? korad_sync(k) : -1;
+}
+
+const char * korad_query(struct korad *k, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	unsigned id = korad_vsubmit(k, 0, fmt, ap);
+	va_end(ap);
+	if (!id)
+		return NULL;
+	struct korad_reply r;
+	for (int c;;)
+		if ((c = korad_complete(k, &r)) < 0 || (!c && wait_io(k)))
+			return NULL;
+		else if (c && r.id == id)
+			return r.data;
+}
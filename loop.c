@@ -0,0 +1,349 @@
+/*
+ * loop.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+# include <linux/io_uring.h>
+# ifdef IORING_ENTER_EXT_ARG
+#  define HAVE_URING	1
+# endif
+#endif
+
+#include "korad.h"
+
+#define EPOLL_EVENTS	64
+
+struct entry {
+	struct korad *k;
+	int fd;
+	short armed;    /* events waited for */
+	int ready;      /* not yet reported by korad_loop_wait() */
+	int inflight;   /* io_uring: poll request submitted */
+	unsigned gen;   /* io_uring: generation of that request */
+};
+
+#ifdef HAVE_URING
+#define URING_ENTRIES	256
+#define REMOVE_TAG	(~(__u64)0)
+
+struct uring {
+	unsigned *sq_head, *sq_tail, sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq, *cq;
+	size_t sq_sz, cq_sz, sqes_sz;
+	unsigned to_submit;
+};
+#endif
+
+struct korad_loop {
+	int backend;
+	int fd;         /* of the epoll or io_uring instance */
+	struct entry *e;
+	unsigned n;
+#ifdef HAVE_URING
+	struct uring u;
+#endif
+};
+
+static int epoll_init(struct korad_loop *l)
+{
+	return (l->fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ? -1 : 0;
+}
+
+static int epoll_arm(struct korad_loop *l, unsigned i, short ev)
+{
+	struct entry *e = &l->e[i];
+	struct epoll_event ee = { .data.u32 = i };
+	if (ev == e->armed)
+		return 0;
+	if (ev & POLLIN)
+		ee.events |= EPOLLIN;
+	if (ev & POLLOUT)
+		ee.events |= EPOLLOUT;
+	if (epoll_ctl(l->fd, EPOLL_CTL_MOD, e->fd, &ee))
+		return -1;
+	e->armed = ev;
+	return 0;
+}
+
+static int epoll_wait_ms(struct korad_loop *l, int timeout_ms)
+{
+	struct epoll_event ev[EPOLL_EVENTS];
+	int r = epoll_wait(l->fd, ev, EPOLL_EVENTS, timeout_ms);
+	for (int i = 0; i < r; i++)
+		l->e[ev[i].data.u32].ready = 1;
+	return r < 0 ? -1 : 0;
+}
+
+#ifdef HAVE_URING
+/* The poll requests of all handles are (re-)armed in the submission queue
+ * and submitted together with waiting for completions by a single
+ * io_uring_enter(). Requests are one-shot, one whose events are no longer
+ * wanted is removed unless no events are wanted at all. */
+
+static int uring_enter(struct korad_loop *l, unsigned wait, unsigned flags,
+                       void *arg, size_t sz)
+{
+	int r = syscall(__NR_io_uring_enter, l->fd, l->u.to_submit, wait,
+	                flags, arg, sz);
+	if (r >= 0)
+		l->u.to_submit -= r;
+	return r;
+}
+
+static void * uring_mmap(int fd, size_t sz, off_t off)
+{
+	return mmap(NULL, sz, PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_POPULATE, fd, off);
+}
+
+static int uring_init(struct korad_loop *l)
+{
+	struct io_uring_params p;
+	struct uring *u = &l->u;
+	memset(&p, 0, sizeof(p));
+	if ((l->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(*u->cqes);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sq_sz = u->cq_sz = u->sq_sz > u->cq_sz ? u->sq_sz : u->cq_sz;
+	u->sqes_sz = p.sq_entries * sizeof(*u->sqes);
+	u->sq = uring_mmap(l->fd, u->sq_sz, IORING_OFF_SQ_RING);
+	u->cq = p.features & IORING_FEAT_SINGLE_MMAP
+	      ? u->sq : uring_mmap(l->fd, u->cq_sz, IORING_OFF_CQ_RING);
+	u->sqes = uring_mmap(l->fd, u->sqes_sz, IORING_OFF_SQES);
+	if (u->sq == MAP_FAILED || u->cq == MAP_FAILED ||
+	    u->sqes == MAP_FAILED)
+		return -1;
+	u->sq_head  = (unsigned *)((char *)u->sq + p.sq_off.head);
+	u->sq_tail  = (unsigned *)((char *)u->sq + p.sq_off.tail);
+	u->sq_mask  = *(unsigned *)((char *)u->sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq + p.sq_off.array);
+	u->cq_head  = (unsigned *)((char *)u->cq + p.cq_off.head);
+	u->cq_tail  = (unsigned *)((char *)u->cq + p.cq_off.tail);
+	u->cq_mask  = *(unsigned *)((char *)u->cq + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe *)((char *)u->cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_fini(struct korad_loop *l)
+{
+	struct uring *u = &l->u;
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq && u->cq != MAP_FAILED && u->cq != u->sq)
+		munmap(u->cq, u->cq_sz);
+	if (u->sq && u->sq != MAP_FAILED)
+		munmap(u->sq, u->sq_sz);
+}
+
+/* Returns a cleared submission queue entry, submitting the queue if it is
+ * full. */
+static struct io_uring_sqe * uring_sqe(struct korad_loop *l)
+{
+	struct uring *u = &l->u;
+	unsigned tail = *u->sq_tail;
+	while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+	       u->sq_mask)
+		if (uring_enter(l, 0, 0, NULL, 0) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			return NULL;
+	struct io_uring_sqe *s = &u->sqes[tail & u->sq_mask];
+	memset(s, 0, sizeof(*s));
+	u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return s;
+}
+
+static int uring_arm(struct korad_loop *l, unsigned i, short ev)
+{
+	struct entry *e = &l->e[i];
+	struct io_uring_sqe *s;
+	if (!ev || (e->inflight && ev == e->armed))
+		return 0;
+	if (e->inflight) {
+		if (!(s = uring_sqe(l)))
+			return -1;
+		s->opcode = IORING_OP_POLL_REMOVE;
+		s->fd = -1;
+		s->addr = (__u64)e->gen << 32 | i;
+		s->user_data = REMOVE_TAG;
+	}
+	if (!(s = uring_sqe(l)))
+		return -1;
+	s->opcode = IORING_OP_POLL_ADD;
+	s->fd = e->fd;
+	s->poll32_events = ev;
+	s->user_data = (__u64)++e->gen << 32 | i;
+	e->inflight = 1;
+	e->armed = ev;
+	return 0;
+}
+
+static int uring_wait_ms(struct korad_loop *l, int timeout_ms)
+{
+	struct uring *u = &l->u;
+	struct __kernel_timespec ts = {
+		timeout_ms / 1000, timeout_ms % 1000 * 1000000LL
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = timeout_ms < 0 ? 0 : (__u64)(uintptr_t)&ts,
+	};
+	if (uring_enter(l, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+	                &arg, sizeof(arg)) < 0 && errno != ETIME &&
+	    errno != EINTR)
+		return -1;
+
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		__u64 d = u->cqes[head & u->cq_mask].user_data;
+		unsigned i = d & 0xffffffff;
+		if (d == REMOVE_TAG || i >= l->n || !l->e[i].inflight ||
+		    l->e[i].gen != d >> 32)
+			continue;
+		l->e[i].inflight = 0;
+		l->e[i].ready = 1;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+#endif
+
+struct korad_loop * korad_loop_create(int backend)
+{
+	struct korad_loop *l = calloc(1, sizeof(*l));
+	if (!l)
+		return NULL;
+	l->fd = -1;
+#ifdef HAVE_URING
+	if (backend != KORAD_LOOP_EPOLL) {
+		if (!uring_init(l)) {
+			l->backend = KORAD_LOOP_URING;
+			return l;
+		}
+		int e = errno;
+		uring_fini(l);
+		if (l->fd >= 0)
+			close(l->fd);
+		memset(&l->u, 0, sizeof(l->u));
+		l->fd = -1;
+		errno = e;
+	}
+#endif
+	if (backend == KORAD_LOOP_URING || epoll_init(l)) {
+#ifndef HAVE_URING
+		if (backend == KORAD_LOOP_URING)
+			errno = ENOSYS;
+#endif
+		free(l);
+		return NULL;
+	}
+	l->backend = KORAD_LOOP_EPOLL;
+	return l;
+}
+
+void korad_loop_close(struct korad_loop *l)
+{
+	if (!l)
+		return;
+#ifdef HAVE_URING
+	if (l->backend == KORAD_LOOP_URING)
+		uring_fini(l);
+#endif
+	close(l->fd);
+	free(l->e);
+	free(l);
+}
+
+int korad_loop_backend(const struct korad_loop *l)
+{
+	return l->backend;
+}
+
+int korad_loop_add(struct korad_loop *l, struct korad *k)
+{
+	struct entry *e = realloc(l->e, sizeof(*e) * (l->n + 1));
+	if (!e)
+		return -1;
+	l->e = e;
+	e = &e[l->n];
+	memset(e, 0, sizeof(*e));
+	e->k = k;
+	e->fd = korad_fd(k);
+	if (l->backend == KORAD_LOOP_EPOLL) {
+		struct epoll_event ee = { .data.u32 = l->n };
+		if (epoll_ctl(l->fd, EPOLL_CTL_ADD, e->fd, &ee))
+			return -1;
+	}
+	return l->n++;
+}
+
+int korad_loop_wait(struct korad_loop *l, int timeout_ms, unsigned *ready,
+                    unsigned max)
+{
+	int to = timeout_ms;
+	for (unsigned i = 0; i < l->n; i++) {
+		struct entry *e = &l->e[i];
+		int t = korad_timeout(e->k);
+		if (e->ready)
+			t = 0;
+		if (t >= 0 && (to < 0 || t < to))
+			to = t;
+		short ev = korad_events(e->k);
+		int r;
+#ifdef HAVE_URING
+		if (l->backend == KORAD_LOOP_URING)
+			r = uring_arm(l, i, ev);
+		else
+#endif
+			r = epoll_arm(l, i, ev);
+		if (r)
+			return -1;
+	}
+
+	int r;
+#ifdef HAVE_URING
+	if (l->backend == KORAD_LOOP_URING)
+		r = uring_wait_ms(l, to);
+	else
+#endif
+		r = epoll_wait_ms(l, to);
+	if (r && errno != EINTR)
+		return -1;
+
+	unsigned n = 0;
+	for (unsigned i = 0; i < l->n && n < max; i++) {
+		struct entry *e = &l->e[i];
+		/* pacing delays have ended */
+		if (e->ready || !korad_timeout(e->k)) {
+			e->ready = 0;
+			ready[n++] = i;
+		}
+	}
+	return n;
+}
@@ -0,0 +1,150 @@
+/*
+ * models.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "korad.h"
+
+#define ARRAY_SIZE(a)	(sizeof(a)/sizeof(*(a)))
+
+/* The reply to *IDN? is not terminated by all firmware versions and is read
+ * before the model is known, hence it also ends after a pause. So does that
+ * to STATUS? of unknown devices. */
+static const struct korad_frame_rule generic_frames[] = {
+	{ "STATUS?", { 0, 20e6 } },
+	{ "*IDN?",   { 0, 20e6 } },
+	{ NULL },
+};
+
+/* Older firmware replies to STATUS? by the raw byte alone. */
+static const struct korad_frame_rule raw_status_frames[] = {
+	{ "STATUS?", { 1, 0 } },
+	{ "*IDN?",   { 0, 20e6 } },
+	{ NULL },
+};
+
+/* Used for handles of unknown devices, delays are those the KD3005P V6.6
+ * was originally driven with. */
+const struct korad_model korad_generic = {
+	.idn = "", .name = "generic", .channels = 1,
+	.set_ns = 50e6, .out_ns = 50e6, .prot_ns = 50e6, .mem_ns = 50e6,
+	.v_fmt = "%05.2f", .i_fmt = "%.3f",
+	.cv = { 0x01 }, .out = 0x40, .ocp = 0x20,
+	.frames = generic_frames,
+};
+
+/* Known models, more specific entries first. New entries start from the
+ * generic delays; korad-bench helps to shorten them. */
+static const struct korad_model models[] = {
+	{
+		.idn = "KORADKD3005PV6", .name = "KD3005P", .channels = 1,
+		.set_ns = 50e6, .out_ns = 50e6, .prot_ns = 50e6,
+		.mem_ns = 50e6,
+		.v_fmt = "%05.2f", .i_fmt = "%.3f",
+		.cv = { 0x01 }, .out = 0x40, .ocp = 0x20,
+		.frames = generic_frames,
+	}, {
+		/* older firmware reports "KORADKD3005PV2.0" without spaces */
+		.idn = "KORADKD3005P", .name = "KD3005P", .channels = 1,
+		.set_ns = 50e6, .out_ns = 100e6, .prot_ns = 50e6,
+		.mem_ns = 100e6,
+		.v_fmt = "%05.2f", .i_fmt = "%.3f",
+		.cv = { 0x01 }, .out = 0x40,
+		.frames = raw_status_frames,
+	}, {
+		.idn = "KORADKD3005D", .name = "KD3005D", .channels = 1,
+		.set_ns = 50e6, .out_ns = 100e6, .prot_ns = 50e6,
+		.mem_ns = 100e6,
+		.v_fmt = "%05.2f", .i_fmt = "%.3f",
+		.cv = { 0x01 }, .out = 0x40,
+		.frames = raw_status_frames,
+	}, {
+		.idn = "KORADKA3005P", .name = "KA3005P", .channels = 1,
+		.set_ns = 50e6, .out_ns = 100e6, .prot_ns = 50e6,
+		.mem_ns = 100e6,
+		.v_fmt = "%05.2f", .i_fmt = "%.3f",
+		.cv = { 0x01 }, .out = 0x40,
+		.frames = raw_status_frames,
+	}, {
+		.idn = "KORADKA3305P", .name = "KA3305P", .channels = 2,
+		.set_ns = 50e6, .out_ns = 100e6, .prot_ns = 50e6,
+		.mem_ns = 100e6,
+		.v_fmt = "%05.2f", .i_fmt = "%.3f",
+		.cv = { 0x01, 0x02 }, .out = 0x40,
+		.frames = raw_status_frames,
+	}, {
+		/* rebranded KA3005P, e.g. "TENMA 72-2540 V2.1" */
+		.idn = "TENMA72-", .name = "Tenma 72-series", .channels = 1,
+		.set_ns = 50e6, .out_ns = 100e6, .prot_ns = 50e6,
+		.mem_ns = 100e6,
+		.v_fmt = "%05.2f", .i_fmt = "%.3f",
+		.cv = { 0x01 }, .out = 0x40,
+		.frames = raw_status_frames,
+	},
+};
+
+/* Returns whether 'idn' without spaces starts with 'prefix'. */
+static int matches(const char *idn, const char *prefix)
+{
+	while (*prefix)
+		if (*idn == ' ')
+			idn++;
+		else if (*idn++ != *prefix++)
+			return 0;
+	return 1;
+}
+
+const struct korad_model * korad_model(const char *idn)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(models); i++)
+		if (matches(idn, models[i].idn))
+			return &models[i];
+	return NULL;
+}
+
+int korad_supported(const char *idn)
+{
+	return korad_model(idn) != NULL;
+}
+
+long korad_delay(const struct korad_model *m, const char *cmd)
+{
+	static const struct { const char *cmd; size_t off; } delays[] = {
+		{ "VSET", offsetof(struct korad_model, set_ns) },
+		{ "ISET", offsetof(struct korad_model, set_ns) },
+		{ "OUT",  offsetof(struct korad_model, out_ns) },
+		{ "OCP",  offsetof(struct korad_model, prot_ns) },
+		{ "OVP",  offsetof(struct korad_model, prot_ns) },
+		{ "SAV",  offsetof(struct korad_model, mem_ns) },
+		{ "RCL",  offsetof(struct korad_model, mem_ns) },
+	};
+	/* queries are paced by their reply */
+	if (strchr(cmd, '?'))
+		return 0;
+	for (size_t i = 0; i < ARRAY_SIZE(delays); i++)
+		if (!strncmp(cmd, delays[i].cmd, strlen(delays[i].cmd)))
+			return *(const long *)((const char *)m + delays[i].off);
+	return m->set_ns;
+}
+
+struct korad_framing korad_framing(const struct korad_model *m,
+                                   const char *cmd)
+{
+	for (const struct korad_frame_rule *r = m->frames; r && r->cmd; r++)
+		if (!strncmp(cmd, r->cmd, strlen(r->cmd)))
+			return r->f;
+	return (struct korad_framing){ 0, 0 };
+}
+
+unsigned korad_status(const struct korad_model *m, unsigned raw, unsigned ch)
+{
+	return (ch < m->channels && raw & m->cv[ch] ? KORAD_ST_CV : 0) |
+	       (raw & m->out ? KORAD_ST_OUT : 0) |
+	       (raw & m->ocp ? KORAD_ST_OCP : 0);
+}
@@ -0,0 +1,519 @@
+/*
+ * mon.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+
+#include "korad.h"
+#include "mon.h"
+#include "tlm.h"
+#include "klog.h"
+
+_Static_assert(N_FIELDS == TLM_FIELDS, "fields do not match tlm.h");
+
+const char *const field_names[N_FIELDS] = {
+	[STATUS] = "status",
+	[VSET]   = "vset",
+	[ISET]   = "iset",
+	[VOUT]   = "vout",
+	[IOUT]   = "iout",
+};
+
+const char *const field_queries[N_FIELDS] = {
+	[STATUS] = "STATUS?",
+	[VSET]   = "VSET%u?",
+	[ISET]   = "ISET%u?",
+	[VOUT]   = "VOUT%u?",
+	[IOUT]   = "IOUT%u?",
+};
+
+/* fixed-point scale of the binary representation */
+static const double field_scale[N_FIELDS] = {
+	[STATUS] = 1,
+	[VSET]   = 100,
+	[ISET]   = 1000,
+	[VOUT]   = 100,
+	[IOUT]   = 1000,
+};
+
+/* interval to rewrite the counters in absence of events */
+#define COUNTERS_NS	1000000000LL
+
+static const char *const field_units[N_FIELDS] = {
+	[VSET] = "/V",
+	[ISET] = "/A",
+	[VOUT] = "/V",
+	[IOUT] = "/A",
+};
+
+/* Operating modes distinguished by the status byte, where 0x40 is set while
+ * the output is on, 0x01 in CV and cleared in CC mode and 0x20 while OCP is
+ * enabled. */
+enum mode { OFF, CV, CC, N_MODES };
+
+static const char *const mode_names[N_MODES] = { "off", "cv", "cc" };
+
+/* Counters kept from the status of consecutive samples, times in ns since
+ * monitoring started, -1 if the event did not happen yet. */
+struct counters {
+	long long mode_ns[N_MODES];
+	unsigned long transitions;     /* between CV and CC while on */
+	unsigned long trips;           /* off with OCP enabled */
+	unsigned long toggles;         /* of the output */
+	long long transition_t, trip_t, toggle_t;
+	int status;                    /* of the previous sample, -1: none */
+	long long t;                   /* time of the previous sample */
+};
+
+struct dev {
+	struct korad *k;               /* shared by the channels of a device */
+	const char *name;
+	unsigned ch;
+	unsigned qid[N_FIELDS];
+	unsigned outstanding;          /* replies of the current sample */
+	char val[N_FIELDS][KORAD_REPLY_MAX];
+	double v, i;                   /* previous sample */
+	int status, have_prev;
+	unsigned seen;                 /* fields with a value in val[] */
+	long long interval, next, t;   /* t: time the sample was started */
+	long taken;
+	struct tlm_sample out;         /* last sample output */
+	long long key_t;               /* time of the last keyframe */
+	struct counters c;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static long long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int parse_fields(const char *spec, unsigned div[N_FIELDS])
+{
+	memset(div, 0, sizeof(*div) * N_FIELDS);
+	for (const char *s = spec; *s;) {
+		size_t n = strcspn(s, "/,");
+		enum field f;
+		for (f = 0; f < N_FIELDS; f++)
+			if (strlen(field_names[f]) == n &&
+			    !strncmp(s, field_names[f], n))
+				break;
+		if (f == N_FIELDS)
+			return -1;
+		s += n;
+		div[f] = 1;
+		if (*s == '/') {
+			char *end;
+			long d = strtol(s + 1, &end, 10);
+			if (end == s + 1 || d <= 0)
+				return -1;
+			div[f] = d;
+			s = end;
+		}
+		if (*s == ',') {
+			if (!*++s)
+				return -1;
+		} else if (*s)
+			return -1;
+	}
+	return 0;
+}
+
+/* Submits the queries of those fields due in this sample. */
+static int start(struct dev *d, const struct mon_opts *o, long long t)
+{
+	d->t = t;
+	for (enum field f = 0; f < N_FIELDS; f++) {
+		d->qid[f] = 0;
+		if (!o->div[f] || d->taken % o->div[f])
+			continue;
+		d->qid[f] = korad_submit(d->k, 0, field_queries[f], d->ch);
+		if (!d->qid[f])
+			return -1;
+		d->outstanding++;
+	}
+	return 0;
+}
+
+/* Stores the reply to the query of field f, the status translated to the
+ * layout of the KD3005P, i.e. the KORAD_ST_* flags. */
+static void store(struct dev *d, enum field f, const struct korad_reply *r)
+{
+	memcpy(d->val[f], r->data, r->len + 1);
+	if (f == STATUS)
+		d->val[f][0] = korad_status(korad_get_model(d->k),
+		                            (unsigned char)r->data[0],
+		                            d->ch - 1);
+	d->seen |= 1U << f;
+	d->outstanding--;
+}
+
+/* Adapts the sampling interval to the sample just completed. */
+static void adapt(struct dev *d, const struct mon_opts *o)
+{
+	double v = atof(d->val[VOUT]), i = atof(d->val[IOUT]);
+	int status = (unsigned char)d->val[STATUS][0];
+	/* fields not monitored compare equal */
+	if (d->have_prev && (fabs(v - d->v) > o->dv ||
+	                     fabs(i - d->i) > o->di ||
+	                     ((status ^ d->status) & 0x01)))
+		d->interval = o->min_ns;
+	else if ((d->interval *= 2) > o->max_ns)
+		d->interval = o->max_ns;
+	d->v = v;
+	d->i = i;
+	d->status = status;
+	d->have_prev = 1;
+	d->next = d->t + d->interval;
+}
+
+static enum mode mode(int status)
+{
+	return !(status & 0x40) ? OFF : status & 0x01 ? CV : CC;
+}
+
+/* Updates the counters by the sample just completed, attributing the time
+ * since the previous one to the previous mode. Returns whether an event was
+ * counted. */
+static int count(struct dev *d, long long t0)
+{
+	struct counters *c = &d->c;
+	/* only freshly queried status bytes tell about events */
+	if (!d->qid[STATUS])
+		return 0;
+	int st = (unsigned char)d->val[STATUS][0], prev = c->status;
+	long long t = d->t - t0;
+	enum mode m = mode(st), pm = mode(prev);
+	int ev = 0;
+	c->status = st;
+	if (prev < 0) {
+		c->t = t;
+		return 0;
+	}
+	c->mode_ns[pm] += t - c->t;
+	c->t = t;
+	if (pm != OFF && m != OFF && pm != m) {
+		c->transitions++;
+		c->transition_t = t;
+		ev = 1;
+	}
+	if ((prev ^ st) & 0x40) {
+		c->toggles++;
+		c->toggle_t = t;
+		ev = 1;
+	}
+	if (pm != OFF && m == OFF && prev & st & 0x20) {
+		c->trips++;
+		c->trip_t = t;
+	}
+	return ev;
+}
+
+static void put_counters(FILE *f, const struct dev *d, unsigned n,
+                         uint64_t t0_real)
+{
+	static const char *const type[] = {
+		"mode_seconds counter", "transitions_total counter",
+		"ocp_trips_total counter", "output_toggles_total counter",
+		"last_transition_seconds gauge", "last_ocp_trip_seconds gauge",
+		"last_output_toggle_seconds gauge",
+	};
+	for (unsigned j = 0; j < sizeof(type)/sizeof(*type); j++) {
+		int l = strcspn(type[j], " ");
+		fprintf(f, "# TYPE korad_%s\n", type[j]);
+		for (unsigned i = 0; i < n; i++) {
+			const struct counters *c = &d[i].c;
+			long long v[] = {
+				0, c->transitions, c->trips, c->toggles,
+				c->transition_t, c->trip_t, c->toggle_t,
+			};
+			if (!j) {
+				for (enum mode m = 0; m < N_MODES; m++)
+					fprintf(f, "korad_%.*s{dev=\"%s\","
+					        "mode=\"%s\"} %.6f\n", l, type[j],
+					        d[i].name, mode_names[m],
+					        c->mode_ns[m] * 1e-9);
+			} else if (j < 4) {
+				fprintf(f, "korad_%.*s{dev=\"%s\"} %lld\n", l,
+				        type[j], d[i].name, v[j]);
+			} else if (v[j] >= 0) {
+				fprintf(f, "korad_%.*s{dev=\"%s\"} %.6f\n", l,
+				        type[j], d[i].name,
+				        t0_real * 1e-6 + v[j] * 1e-9);
+			}
+		}
+	}
+}
+
+/* Atomically replaces 'path' by the current counters. */
+static int write_counters(const char *path, const struct dev *d,
+                          unsigned n, uint64_t t0_real)
+{
+	char *tmp;
+	if (asprintf(&tmp, "%s.tmp", path) == -1)
+		return -1;
+	FILE *f = fopen(tmp, "w");
+	int r = -1;
+	if (f) {
+		put_counters(f, d, n, t0_real);
+		r = ferror(f) | fclose(f) ? -1 : rename(tmp, path);
+		if (r)
+			unlink(tmp);
+	}
+	free(tmp);
+	return r;
+}
+
+static void to_sample(const struct dev *d, long long t0,
+                      struct tlm_sample *s)
+{
+	s->t = (d->t - t0) / 1000;
+	s->valid = d->seen;
+	for (enum field f = 0; f < N_FIELDS; f++)
+		s->v[f] = f == STATUS ? (unsigned char)d->val[f][0]
+		                      : lround(atof(d->val[f]) * field_scale[f]);
+}
+
+static void print(const struct dev *d, const struct mon_opts *o,
+                  long long t0, int name)
+{
+	printf("%.6f", (d->t - t0) * 1e-9);
+	if (name)
+		printf(" %s", d->name);
+	for (enum field f = 0; f < N_FIELDS; f++)
+		if (!o->div[f])
+			continue;
+		else if (!(d->seen & 1U << f))
+			printf(" -");
+		else if (f == STATUS)
+			printf(" 0x%02hhx", d->val[f][0]);
+		else
+			printf(" %s", d->val[f]);
+	printf("\n");
+}
+
+/* Outputs the sample just completed by device i unless suppressed. */
+static void emit(struct dev *d, unsigned i, const struct mon_opts *o,
+                 long long t0, int name, const struct tlm_sample *sp)
+{
+	struct tlm_sample s = *sp;
+	int key = !d->out.valid || d->t - d->key_t >= o->key_ns;
+	if (!key && o->changes && s.valid == d->out.valid &&
+	    !memcmp(s.v, d->out.v, sizeof(s.v)))
+		return;
+	if (o->binary) {
+		uint8_t buf[TLM_REC_MAX];
+		fwrite(buf, tlm_encode(buf, i, &d->out, &s, key), 1, stdout);
+	} else
+		print(d, o, t0, name);
+	d->out = s;
+	if (key)
+		d->key_t = d->t;
+}
+
+static unsigned field_mask(const struct mon_opts *o)
+{
+	unsigned mask = 0;
+	for (enum field f = 0; f < N_FIELDS; f++)
+		mask |= (o->div[f] ? 1U : 0) << f;
+	return mask;
+}
+
+static uint64_t realtime_us(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static void header(const struct dev *d, unsigned n, const struct mon_opts *o,
+                   uint64_t t0)
+{
+	if (!o->binary) {
+		printf("# t/s%s", n > 1 ? " dev" : "");
+		for (enum field f = 0; f < N_FIELDS; f++)
+			if (o->div[f])
+				printf(" %s%s", field_names[f],
+				       field_units[f] ? : "");
+		printf("\n");
+		return;
+	}
+	uint8_t buf[2 * 10];
+	printf("%s%c%c", TLM_MAGIC, TLM_VERSION, field_mask(o));
+	size_t len = tlm_put_varint(buf, t0);
+	len += tlm_put_varint(buf + len, n);
+	fwrite(buf, len, 1, stdout);
+	for (unsigned i = 0; i < n; i++) {
+		size_t l = strlen(d[i].name);
+		fwrite(buf, tlm_put_varint(buf, l), 1, stdout);
+		fwrite(d[i].name, l, 1, stdout);
+	}
+}
+
+int run_monitor(struct korad *const *k, const char *const *devs,
+                const unsigned *ch, unsigned n, const struct mon_opts *o)
+{
+	struct dev d[n];
+	struct korad *hk[n];      /* distinct handles, indices in the loop */
+	unsigned nh = 0, ready[n];
+	long long t0 = now_ns();
+	uint64_t t0_real = realtime_us();
+	struct klog *log = NULL;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	memset(d, 0, sizeof(d));
+	for (unsigned i = 0; i < n; i++) {
+		d[i].k = k[i];
+		d[i].ch = ch[i];
+		d[i].name = devs[i];
+		d[i].interval = o->min_ns;
+		d[i].next = t0;
+		d[i].c = (struct counters){
+			.transition_t = -1, .trip_t = -1, .toggle_t = -1,
+			.status = -1,
+		};
+	}
+	long long counters_t = t0;
+
+	struct korad_loop *loop = korad_loop_create(o->backend);
+	if (!loop) {
+		perror("event loop");
+		return 2;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		unsigned j;
+		for (j = 0; j < nh && hk[j] != k[i]; j++);
+		if (j == nh && korad_loop_add(loop, hk[nh++] = k[i]) < 0) {
+			perror("event loop");
+			korad_loop_close(loop);
+			return 2;
+		}
+	}
+
+	header(d, n, o, t0_real);
+	if (o->log && !(log = klog_create(o->log, field_mask(o), t0_real, n,
+	                                  devs, o->key_ns / 1000))) {
+		perror(o->log);
+		korad_loop_close(loop);
+		return 1;
+	}
+	for (unsigned done = 0; !stop && done < n;) {
+		long long t = now_ns(), wake = LLONG_MAX;
+		done = 0;
+		for (unsigned i = 0; i < n; i++) {
+			if (o->count && d[i].taken == o->count) {
+				done++;
+				continue;
+			}
+			if (!d[i].outstanding && t >= d[i].next &&
+			    start(&d[i], o, t))
+				goto err;
+			if (!d[i].outstanding && d[i].next < wake)
+				wake = d[i].next;
+		}
+		if (done == n)
+			break;
+
+		/* the loop accounts for the pacing delays */
+		int to = wake == LLONG_MAX ? -1 : (wake - t + 999999) / 1000000;
+		int nr = korad_loop_wait(loop, to, ready, nh);
+		if (nr < 0)
+			perror("event loop"), exit(2);
+
+		for (int i = 0; i < nr; i++) {
+			struct korad *h = hk[ready[i]];
+			struct korad_reply r;
+			int c;
+			while ((c = korad_complete(h, &r)) > 0)
+				for (unsigned j = 0; j < n; j++)
+					for (enum field f = 0; f < N_FIELDS;
+					     f++)
+						if (k[j] == h &&
+						    d[j].qid[f] == r.id)
+							store(&d[j], f, &r);
+			if (c < 0) {
+				for (unsigned j = 0; j < n; j++)
+					if (k[j] == h) {
+						fprintf(stderr, "%s: error: "
+						        "%s\n", d[j].name,
+						        strerror(errno));
+						break;
+					}
+				korad_loop_close(loop);
+				return 2;
+			}
+		}
+		int event = 0;
+		for (unsigned i = 0; i < n; i++) {
+			if (d[i].t && !d[i].outstanding) {
+				struct tlm_sample s;
+				to_sample(&d[i], t0, &s);
+				emit(&d[i], i, o, t0, n > 1, &s);
+				if (log && klog_put(log, i, &s))
+					goto err_log;
+				event |= count(&d[i], t0);
+				d[i].taken++;
+				adapt(&d[i], o);
+				d[i].t = 0;
+			}
+		}
+		fflush(stdout);
+		if (o->counters && (event || t - counters_t >= COUNTERS_NS)) {
+			if (write_counters(o->counters, d, n, t0_real))
+				goto err_counters;
+			counters_t = t;
+		}
+	}
+	if (o->counters && write_counters(o->counters, d, n, t0_real))
+		goto err_counters;
+	if (log && klog_close(log)) {
+		log = NULL;
+		goto err_log;
+	}
+	korad_loop_close(loop);
+	return 0;
+
+err:
+	perror("submit");
+	if (log)
+		klog_close(log);
+	korad_loop_close(loop);
+	return 2;
+err_log:
+	perror(o->log);
+	if (log)
+		klog_close(log);
+	korad_loop_close(loop);
+	return 2;
+err_counters:
+	perror(o->counters);
+	if (log)
+		klog_close(log);
+	korad_loop_close(loop);
+	return 2;
+}
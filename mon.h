@@ -0,0 +1,65 @@
+/*
+ * mon.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef MON_H
+#define MON_H
+
+struct korad;
+
+/* Quantities that can be queried. */
+enum field { STATUS, VSET, ISET, VOUT, IOUT, N_FIELDS };
+
+/* names of the fields and formats of their queries taking the channel */
+extern const char *const field_names[N_FIELDS];
+extern const char *const field_queries[N_FIELDS];
+
+/* Parses a comma-separated list of field names, each optionally followed by
+ * '/N' to query it only every N-th sample, into div[], where unselected
+ * fields have a divisor of 0. Returns 0 on success and -1 on error. */
+int parse_fields(const char *spec, unsigned div[N_FIELDS]);
+
+struct mon_opts {
+	unsigned div[N_FIELDS];   /* per field: query every div-th sample */
+	long long min_ns, max_ns; /* range of the sampling interval */
+	double dv, di;            /* changes considered transients */
+	long count;               /* samples per device, 0: no limit */
+	int changes, binary;      /* output only changes, binary output */
+	long long key_ns;         /* interval between keyframes */
+	const char *log;          /* segmented log to write, NULL: none */
+	const char *counters;     /* file to export counters to, NULL: none */
+	int backend;              /* of the event loop, see korad_loop */
+};
+
+/* Samples the selected fields of channel ch[i] of each device k[i] and
+ * prints one line per sample until 'count' samples have been taken or
+ * SIGINT or SIGTERM is received. Channels of the same device share its
+ * handle, their queries are queued back-to-back. All handles are waited for
+ * by one korad_loop using 'backend'.
+ * Fields not queried in a sample keep their last value. The sampling
+ * interval of a device drops to 'min_ns' whenever the output changes by more
+ * than 'dv' or 'di' or the CV/CC mode flips and doubles after each sample
+ * without such a change up to 'max_ns'.
+ *
+ * If 'changes' is set, samples equal to the previous one output for the
+ * same device are suppressed unless 'key_ns' passed since the last keyframe,
+ * i.e. unconditionally output sample. If 'binary' is set, samples are
+ * written as described in tlm.h instead of lines of text. If 'log' is set,
+ * changes are additionally written to that log as described in klog.h in
+ * segments of 'key_ns'.
+ *
+ * From the status byte, the time spent off, in CV and in CC mode, the number
+ * of CV/CC transitions, OCP trips and output toggles and the time of the
+ * last of these are counted. As the device does not report trips as such,
+ * any switching off of the output while OCP is enabled counts as one.
+ * If 'counters' is set, they are written to that file in the Prometheus text
+ * format whenever an event is counted and at least once per second. Returns
+ * the exit status. */
+int run_monitor(struct korad *const *k, const char *const *devs,
+                const unsigned *ch, unsigned n, const struct mon_opts *o);
+
+#endif
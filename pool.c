@@ -0,0 +1,248 @@
+/*
+ * pool.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "korad.h"
+
+/* Single-producer/single-consumer ring. 'tail' is only written by the
+ * producer, 'head' only by the consumer. */
+struct ring {
+	_Atomic size_t head, tail;
+	struct korad_job job[KORAD_POOL_QUEUE];
+};
+
+struct worker {
+	struct korad_pool *p;
+	struct korad *k;
+	pthread_t thread;
+	sem_t todo;          /* number of jobs in 'in' */
+	struct ring in, out; /* coordinator -> worker and back */
+	unsigned inflight;   /* coordinator only: submitted, not gathered */
+};
+
+struct korad_pool {
+	sem_t done;          /* number of jobs in all 'out' rings together */
+	pthread_barrier_t simul;
+	unsigned n, next, inflight;
+	struct worker w[];
+};
+
+static int ring_push(struct ring *r, const struct korad_job *j)
+{
+	size_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (t - h == KORAD_POOL_QUEUE)
+		return 0;
+	r->job[t % KORAD_POOL_QUEUE] = *j;
+	atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+	return 1;
+}
+
+static int ring_pop(struct ring *r, struct korad_job *j)
+{
+	size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (h == t)
+		return 0;
+	*j = r->job[h % KORAD_POOL_QUEUE];
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+	return 1;
+}
+
+static void run(struct worker *w, struct korad_job *j)
+{
+	struct korad *k = w->k;
+	size_t n = strlen(j->cmd);
+	if (j->simul)
+		pthread_barrier_wait(&w->p->simul);
+	j->err = 0;
+	j->reply[0] = '\0';
+	if (n && j->cmd[n-1] == '?') {
+		const char *r = korad_query(k, "%s", j->cmd);
+		if (r)
+			snprintf(j->reply, sizeof(j->reply), "%s", r);
+		else
+			j->err = errno;
+	} else if (korad_send(k, j->wait_ns, "%s", j->cmd))
+		j->err = errno;
+	j->t = korad_written(k);
+}
+
+static void * work(void *arg)
+{
+	struct worker *w = arg;
+	struct korad_job j;
+	for (;;) {
+		while (sem_wait(&w->todo) && errno == EINTR);
+		if (!ring_pop(&w->in, &j))
+			break; /* woken up by korad_pool_close() */
+		run(w, &j);
+		ring_push(&w->out, &j);
+		sem_post(&w->p->done);
+	}
+	return NULL;
+}
+
+struct korad_pool * korad_pool_create(struct korad *const *k, unsigned n)
+{
+	struct korad_pool *p = calloc(1, sizeof(*p) + n * sizeof(*p->w));
+	if (!p)
+		return NULL;
+	p->n = n;
+	sem_init(&p->done, 0, 0);
+	if ((errno = pthread_barrier_init(&p->simul, NULL, n ? n : 1))) {
+		free(p);
+		return NULL;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		struct worker *w = &p->w[i];
+		w->p = p;
+		w->k = k[i];
+		sem_init(&w->todo, 0, 0);
+		int err = pthread_create(&w->thread, NULL, work, w);
+		if (err) {
+			p->n = i;
+			korad_pool_close(p);
+			errno = err;
+			return NULL;
+		}
+	}
+	return p;
+}
+
+void korad_pool_close(struct korad_pool *p)
+{
+	if (!p)
+		return;
+	for (unsigned i = 0; i < p->n; i++)
+		sem_post(&p->w[i].todo);
+	for (unsigned i = 0; i < p->n; i++) {
+		pthread_join(p->w[i].thread, NULL);
+		sem_destroy(&p->w[i].todo);
+	}
+	sem_destroy(&p->done);
+	pthread_barrier_destroy(&p->simul);
+	free(p);
+}
+
+static int vsubmit(struct korad_pool *p, unsigned dev, unsigned tag,
+                   int simul, long wait_ns, const char *fmt, va_list ap)
+{
+	if (dev >= p->n) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct worker *w = &p->w[dev];
+	if (w->inflight == KORAD_POOL_QUEUE) {
+		errno = EAGAIN;
+		return -1;
+	}
+	struct korad_job j = {
+		.dev = dev,
+		.tag = tag,
+		.wait_ns = wait_ns,
+		.simul = simul,
+	};
+	int n = vsnprintf(j.cmd, sizeof(j.cmd), fmt, ap);
+	if (n < 0)
+		return -1;
+	if ((size_t)n >= sizeof(j.cmd) - 1) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	ring_push(&w->in, &j);
+	w->inflight++;
+	p->inflight++;
+	sem_post(&w->todo);
+	return 0;
+}
+
+int korad_pool_vsubmit(struct korad_pool *p, unsigned dev, unsigned tag,
+                       long wait_ns, const char *fmt, va_list ap)
+{
+	return vsubmit(p, dev, tag, 0, wait_ns, fmt, ap);
+}
+
+int korad_pool_submit(struct korad_pool *p, unsigned dev, unsigned tag,
+                      long wait_ns, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int r = korad_pool_vsubmit(p, dev, tag, wait_ns, fmt, ap);
+	va_end(ap);
+	return r;
+}
+
+static int vbroadcast(struct korad_pool *p, unsigned tag, int simul,
+                      long wait_ns, const char *fmt, va_list ap)
+{
+	/* Check all queues first, a partially submitted korad_pool_simul()
+	 * would block the workers in the barrier forever. */
+	for (unsigned i = 0; i < p->n; i++)
+		if (p->w[i].inflight == KORAD_POOL_QUEUE) {
+			errno = EAGAIN;
+			return -1;
+		}
+	for (unsigned i = 0; i < p->n; i++) {
+		va_list aq;
+		va_copy(aq, ap);
+		int r = vsubmit(p, i, tag, simul, wait_ns, fmt, aq);
+		va_end(aq);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+int korad_pool_broadcast(struct korad_pool *p, unsigned tag, long wait_ns,
+                         const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int r = vbroadcast(p, tag, 0, wait_ns, fmt, ap);
+	va_end(ap);
+	return r;
+}
+
+int korad_pool_simul(struct korad_pool *p, unsigned tag, long wait_ns,
+                     const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int r = vbroadcast(p, tag, 1, wait_ns, fmt, ap);
+	va_end(ap);
+	return r;
+}
+
+int korad_pool_gather(struct korad_pool *p, struct korad_job *j)
+{
+	if (!p->inflight)
+		return 0;
+	while (sem_wait(&p->done))
+		if (errno != EINTR)
+			return -1;
+	for (unsigned i = 0;; i++) {
+		struct worker *w = &p->w[(p->next + i) % p->n];
+		if (ring_pop(&w->out, j)) {
+			p->next = (p->next + i + 1) % p->n;
+			w->inflight--;
+			p->inflight--;
+			return 1;
+		}
+	}
+}
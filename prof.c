@@ -0,0 +1,421 @@
+/*
+ * prof.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include "korad.h"
+#include "prof.h"
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+#define N_SLOTS		5
+#define MAX_CH		8
+
+/* tags of the jobs: queries of setpoints go to set[dev][slot][ch][i] */
+#define TAG(slot,ch,i)	((slot) << 8 | (ch) << 1 | (i))
+enum { STATUS_TAG = 1 << 16, SEND_TAG };
+
+struct entry {
+	unsigned slot, ch;
+	char v[16], i[16];
+};
+
+/* per device: setpoints of the slots, slot 0 holds the ones found before */
+static char (*set)[N_SLOTS + 1][MAX_CH][2][KORAD_REPLY_MAX];
+static unsigned char *status;
+
+static void gather(struct korad_pool *p, const char *const *devs)
+{
+	struct korad_job j;
+	for (int r; (r = korad_pool_gather(p, &j));) {
+		if (r < 0)
+			perror("gather"), exit(2);
+		if (j.err)
+			DIE(2,"%s: error %s %s: %s\n",devs[j.dev],
+			    j.tag == SEND_TAG ? "sending" : "reading output of",
+			    j.cmd,strerror(j.err));
+		if (j.tag == STATUS_TAG)
+			status[j.dev] = j.reply[0];
+		else if (j.tag != SEND_TAG)
+			memcpy(set[j.dev][j.tag >> 8][j.tag >> 1 & 0x7f][j.tag & 1],
+			       j.reply, sizeof(j.reply));
+	}
+}
+
+static void submit(struct korad_pool *p, const char *const *devs,
+                   unsigned dev, unsigned tag, long wait_ns,
+                   const char *fmt, ...)
+	__attribute__((format(printf,6,7)));
+
+/* Queues a job, waiting for the queued ones to finish if the queue is
+ * full. */
+static void submit(struct korad_pool *p, const char *const *devs,
+                   unsigned dev, unsigned tag, long wait_ns,
+                   const char *fmt, ...)
+{
+	for (int r = -1; r;) {
+		va_list ap;
+		va_start(ap, fmt);
+		r = korad_pool_vsubmit(p, dev, tag, wait_ns, fmt, ap);
+		va_end(ap);
+		if (r && errno != EAGAIN)
+			perror("send"), exit(2);
+		if (r)
+			gather(p, devs);
+	}
+}
+
+/* Queries the setpoints of all channels of device i into slot s. */
+static void query_set(struct korad_pool *p, const char *const *devs,
+                      unsigned i, unsigned channels, unsigned s)
+{
+	for (unsigned c = 0; c < channels; c++) {
+		submit(p, devs, i, TAG(s, c, 0), 0, "VSET%u?", c + 1);
+		submit(p, devs, i, TAG(s, c, 1), 0, "ISET%u?", c + 1);
+	}
+}
+
+/* Reads the status and current setpoints of all devices. */
+static void read_state(struct korad_pool *p, const char *const *devs,
+                       const struct korad_model *const *m, unsigned n)
+{
+	set = calloc(n, sizeof(*set));
+	status = calloc(n, sizeof(*status));
+	if (!set || !status)
+		perror("calloc"), exit(2);
+	for (unsigned i = 0; i < n; i++) {
+		if (m[i]->channels > MAX_CH)
+			DIE(1,"%s: error: too many channels\n",devs[i]);
+		submit(p, devs, i, STATUS_TAG, 0, "STATUS?");
+		query_set(p, devs, i, m[i]->channels, 0);
+	}
+	gather(p, devs);
+}
+
+/* Reads the current setpoints of all devices and checks their outputs are
+ * off. */
+static void begin(struct korad_pool *p, const char *const *devs,
+                  const struct korad_model *const *m, unsigned n)
+{
+	read_state(p, devs, m, n);
+	for (unsigned i = 0; i < n; i++)
+		if (korad_status(m[i], status[i], 0) & KORAD_ST_OUT)
+			DIE(1,"%s: error: output is on, turn it off first\n",
+			    devs[i]);
+}
+
+/* Queues restoring the setpoints found by begin() on device i. */
+static void restore(struct korad_pool *p, const char *const *devs,
+                    unsigned i, unsigned channels)
+{
+	for (unsigned c = 0; c < channels; c++) {
+		submit(p, devs, i, SEND_TAG, KORAD_PACE, "VSET%u:%s", c + 1,
+		       set[i][0][c][0]);
+		submit(p, devs, i, SEND_TAG, KORAD_PACE, "ISET%u:%s", c + 1,
+		       set[i][0][c][1]);
+	}
+}
+
+static void end(void)
+{
+	free(set);
+	free(status);
+	set = NULL;
+	status = NULL;
+}
+
+static void check_name(const char *name)
+{
+	if (!*name || strpbrk(name, " \t\n#"))
+		DIE(1,"error: invalid profile name '%s'\n",name);
+}
+
+/* Writes the file with profile 'name' replaced by the slots read from
+ * device 0. */
+static void save(const char *path, const char *name, unsigned channels)
+{
+	char *tmp;
+	if (asprintf(&tmp, "%s.tmp", path) == -1)
+		perror("asprintf"), exit(2);
+	FILE *in = fopen(path, "r"), *out;
+	if (!in && errno != ENOENT)
+		perror(path), exit(1);
+	if (!(out = fopen(tmp, "w")))
+		perror(tmp), exit(1);
+	if (!in)
+		fprintf(out, "# NAME SLOT CHANNEL VOLTAGE CURRENT\n");
+
+	char *line = NULL, tok[64];
+	size_t sz = 0;
+	for (ssize_t len; in && (len = getline(&line, &sz, in)) > 0;)
+		if (sscanf(line, "%63s", tok) != 1 || strcmp(tok, name))
+			fprintf(out, "%s%s", line,
+			        line[len-1] == '\n' ? "" : "\n");
+	for (unsigned s = 1; s <= N_SLOTS; s++)
+		for (unsigned c = 0; c < channels; c++)
+			fprintf(out, "%s %u %u %s %s\n", name, s, c + 1,
+			        set[0][s][c][0], set[0][s][c][1]);
+	free(line);
+	if (in)
+		fclose(in);
+	if (ferror(out) | fclose(out) || rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		exit(1);
+	}
+	free(tmp);
+}
+
+int profile_get(struct korad_pool *p, const char *const *devs,
+                const struct korad_model *const *m, unsigned n,
+                const char *path, const char *name)
+{
+	check_name(name);
+	if (n != 1)
+		DIE(1,"error: reading a profile needs exactly one device\n");
+	begin(p, devs, m, n);
+	for (unsigned s = 1; s <= N_SLOTS; s++) {
+		submit(p, devs, 0, SEND_TAG, KORAD_PACE, "RCL%u", s);
+		query_set(p, devs, 0, m[0]->channels, s);
+	}
+	restore(p, devs, 0, m[0]->channels);
+	gather(p, devs);
+	save(path, name, m[0]->channels);
+	end();
+	return 0;
+}
+
+static int is_number(const char *s)
+{
+	char *e;
+	strtod(s, &e);
+	return e != s && !*e;
+}
+
+/* Returns the entries of profile 'name' in the file 'path'. */
+static struct entry * load(const char *path, const char *name, unsigned *n)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		perror(path), exit(1);
+	struct entry *e = NULL;
+	char *line = NULL, tok[64];
+	size_t sz = 0;
+	*n = 0;
+	for (unsigned ln = 1; getline(&line, &sz, f) > 0; ln++) {
+		struct entry r;
+		*strchrnul(line, '#') = '\0';
+		if (sscanf(line, "%63s", tok) != 1 || strcmp(tok, name))
+			continue;
+		if (sscanf(line, "%*s %u %u %15s %15s", &r.slot, &r.ch, r.v,
+		           r.i) != 4 || r.slot < 1 || r.slot > N_SLOTS ||
+		    r.ch < 1 || r.ch > MAX_CH || !is_number(r.v) ||
+		    !is_number(r.i))
+			DIE(1,"%s:%u: error: malformed slot\n",path,ln);
+		e = realloc(e, sizeof(*e) * (*n + 1));
+		if (!e)
+			perror("realloc"), exit(2);
+		e[(*n)++] = r;
+	}
+	free(line);
+	fclose(f);
+	if (!*n)
+		DIE(1,"%s: error: no profile '%s'\n",path,name);
+	return e;
+}
+
+int profile_put(struct korad_pool *p, const char *const *devs,
+                const struct korad_model *const *m, unsigned n,
+                const char *path, const char *name)
+{
+	check_name(name);
+	unsigned n_e, used = 0;
+	struct entry *e = load(path, name, &n_e);
+	for (unsigned j = 0; j < n_e; j++)
+		used |= 1U << e[j].slot;
+	for (unsigned i = 0; i < n; i++)
+		for (unsigned j = 0; j < n_e; j++)
+			if (e[j].ch > m[i]->channels)
+				DIE(1,"%s: error: profile '%s' has channel %u, "
+				    "%s only %u\n",devs[i],name,e[j].ch,
+				    m[i]->name,m[i]->channels);
+
+	begin(p, devs, m, n);
+	for (unsigned i = 0; i < n; i++) {
+		for (unsigned s = 1; s <= N_SLOTS; s++) {
+			if (!(used & 1U << s))
+				continue;
+			for (unsigned j = 0; j < n_e; j++) {
+				if (e[j].slot != s)
+					continue;
+				submit(p, devs, i, SEND_TAG, KORAD_PACE,
+				       "VSET%u:%s", e[j].ch, e[j].v);
+				submit(p, devs, i, SEND_TAG, KORAD_PACE,
+				       "ISET%u:%s", e[j].ch, e[j].i);
+			}
+			submit(p, devs, i, SEND_TAG, KORAD_PACE, "SAV%u", s);
+		}
+		restore(p, devs, i, m[i]->channels);
+	}
+	gather(p, devs);
+	for (unsigned i = 0; i < n; i++) {
+		printf("%s: profile '%s' stored in slot(s)", devs[i], name);
+		for (unsigned s = 1, first = 1; s <= N_SLOTS; s++)
+			if (used & 1U << s) {
+				printf("%s%u", first ? " " : ",", s);
+				first = 0;
+			}
+		printf("\n");
+	}
+	free(e);
+	end();
+	return 0;
+}
+
+int state_save(struct korad_pool *p, const char *const *devs,
+               const struct korad_model *const *m, unsigned n,
+               const char *path)
+{
+	read_state(p, devs, m, n);
+	FILE *f = fopen(path, "w");
+	if (!f)
+		perror(path), exit(1);
+	fprintf(f, "# DEV OUT OCP VSET1 ISET1 [VSET2 ISET2 ...]\n");
+	for (unsigned i = 0; i < n; i++) {
+		unsigned st = korad_status(m[i], status[i], 0);
+		fprintf(f, "%s %d %d", devs[i], !!(st & KORAD_ST_OUT),
+		        m[i]->ocp ? !!(st & KORAD_ST_OCP) : -1);
+		for (unsigned c = 0; c < m[i]->channels; c++)
+			fprintf(f, " %s %s", set[i][0][c][0], set[i][0][c][1]);
+		fprintf(f, "\n");
+	}
+	if (ferror(f) | fclose(f))
+		perror(path), exit(1);
+	end();
+	return 0;
+}
+
+/* state of a device as saved by state_save() */
+struct state {
+	int out, ocp;
+	double set[MAX_CH][2];
+};
+
+/* Reads the states of all devices from the file 'path' into s[]. */
+static void load_state(const char *path, const char *const *devs,
+                       const struct korad_model *const *m, unsigned n,
+                       struct state *s)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		perror(path), exit(1);
+	unsigned found[n];
+	memset(found, 0, sizeof(found));
+	char *line = NULL;
+	size_t sz = 0;
+	for (unsigned ln = 1; getline(&line, &sz, f) > 0; ln++) {
+		char dev[256];
+		int off, k;
+		*strchrnul(line, '#') = '\0';
+		if (sscanf(line, "%255s%n", dev, &off) != 1)
+			continue;
+		unsigned i;
+		for (i = 0; i < n && strcmp(dev, devs[i]); i++);
+		if (i == n)
+			continue;
+		struct state *t = &s[i];
+		const char *l = line + off;
+		if (sscanf(l, "%d %d%n", &t->out, &t->ocp, &k) != 2)
+			DIE(1,"%s:%u: error: malformed state\n",path,ln);
+		t->ocp = t->ocp < 0 ? -1 : !!t->ocp;
+		unsigned c;
+		for (c = 0; c < MAX_CH * 2; c++) {
+			l += k;
+			if (sscanf(l, "%lf%n", &t->set[c / 2][c % 2], &k) != 1)
+				break;
+		}
+		if (c != m[i]->channels * 2 || sscanf(l, " %*c") != EOF)
+			DIE(1,"%s:%u: error: state does not match %s with %u "
+			    "channel(s)\n",path,ln,m[i]->name,m[i]->channels);
+		found[i] = 1;
+	}
+	free(line);
+	fclose(f);
+	for (unsigned i = 0; i < n; i++)
+		if (!found[i])
+			DIE(1,"%s: error: no state of %s\n",path,devs[i]);
+}
+
+/* Formats setpoint v, the current if j is set, in the resolution of model m
+ * into buf and returns whether the reply 'cur' differs from it. */
+static int differs(const struct korad_model *m, unsigned j, const char *cur,
+                   double v, char buf[KORAD_REPLY_MAX])
+{
+	char c[KORAD_REPLY_MAX];
+	const char *fmt = j ? m->i_fmt : m->v_fmt;
+	snprintf(c, sizeof(c), fmt, atof(cur));
+	snprintf(buf, KORAD_REPLY_MAX, fmt, v);
+	return strcmp(c, buf);
+}
+
+int state_restore(struct korad_pool *p, const char *const *devs,
+                  const struct korad_model *const *m, unsigned n,
+                  const char *path)
+{
+	struct state *s = calloc(n, sizeof(*s));
+	if (!s)
+		perror("calloc"), exit(2);
+	load_state(path, devs, m, n, s);
+	read_state(p, devs, m, n);
+
+	unsigned sent[n];
+	for (unsigned i = 0; i < n; i++) {
+		unsigned st = korad_status(m[i], status[i], 0);
+		int out = !!(st & KORAD_ST_OUT), ocp = !!(st & KORAD_ST_OCP);
+		char buf[KORAD_REPLY_MAX];
+		sent[i] = 0;
+		/* turn the output off before changing anything, on after */
+		if (out && !s[i].out) {
+			submit(p, devs, i, SEND_TAG, KORAD_PACE, "OUT0");
+			sent[i]++;
+		}
+		for (unsigned c = 0; c < m[i]->channels; c++)
+			for (unsigned j = 0; j < 2; j++)
+				if (differs(m[i], j, set[i][0][c][j],
+				            s[i].set[c][j], buf)) {
+					submit(p, devs, i, SEND_TAG, KORAD_PACE,
+					       j ? "ISET%u:%s" : "VSET%u:%s",
+					       c + 1, buf);
+					sent[i]++;
+				}
+		/* the state of OCP is unknown if not reported */
+		if (s[i].ocp >= 0 && (!m[i]->ocp || ocp != s[i].ocp)) {
+			submit(p, devs, i, SEND_TAG, KORAD_PACE, "OCP%d",
+			       s[i].ocp);
+			sent[i]++;
+		}
+		if (!out && s[i].out) {
+			submit(p, devs, i, SEND_TAG, KORAD_PACE, "OUT1");
+			sent[i]++;
+		}
+	}
+	gather(p, devs);
+	for (unsigned i = 0; i < n; i++)
+		printf("%s: state restored with %u command(s)\n", devs[i],
+		       sent[i]);
+	free(s);
+	end();
+	return 0;
+}
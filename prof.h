@@ -0,0 +1,59 @@
+/*
+ * prof.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+struct korad_pool;
+struct korad_model;
+
+/* Profiles are named sets of memory slot contents kept in a text file. Each
+ * non-empty line not starting with '#' holds the setpoints of one channel of
+ * one slot:
+ *
+ *   NAME SLOT CHANNEL VOLTAGE CURRENT
+ *
+ * Both functions operate on the devices of pool 'p', which must have no jobs
+ * in flight, identified as models m[i]. They refuse to touch devices whose
+ * output is on, as recalling or storing slots changes the setpoints, and
+ * restore the setpoints found before. Return the exit status. */
+
+/* Reads all slots of all channels of the single device by recalling them in
+ * turn and replaces profile 'name' in the file 'path' by them. */
+int profile_get(struct korad_pool *p, const char *const *devs,
+                const struct korad_model *const *m, unsigned n,
+                const char *path, const char *name);
+
+/* Stores the slots of profile 'name' in the file 'path' on all devices. The
+ * commands for each device are queued at once and processed in parallel. */
+int profile_put(struct korad_pool *p, const char *const *devs,
+                const struct korad_model *const *m, unsigned n,
+                const char *path, const char *name);
+
+/* Snapshots hold the output and OCP state and the setpoints of all channels
+ * of devices, one line per device:
+ *
+ *   DEV OUT OCP VSET1 ISET1 [VSET2 ISET2 ...]
+ *
+ * OCP is -1 for models not reporting it, which leaves it unchanged when
+ * restoring. The memory slot last recalled cannot be queried and is not part
+ * of it. */
+
+/* Writes a snapshot of all devices to the file 'path'. */
+int state_save(struct korad_pool *p, const char *const *devs,
+               const struct korad_model *const *m, unsigned n,
+               const char *path);
+
+/* Restores the snapshot in the file 'path' on all devices. Only commands
+ * changing the current state are sent, an output to be turned off is turned
+ * off first and one to be turned on last. */
+int state_restore(struct korad_pool *p, const char *const *devs,
+                  const struct korad_model *const *m, unsigned n,
+                  const char *path);
+
+#endif
@@ -0,0 +1,366 @@
+/*
+ * seq.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+
+#include "korad.h"
+#include "cache.h"
+#include "seq.h"
+
+#define DIE(code,...) do { fprintf(stderr, __VA_ARGS__); exit(code); } while (0)
+
+#define POLL_NS		10000000L	/* gap between readiness queries */
+#define TIMEOUT_MS	5000		/* default readiness timeout */
+
+enum state {
+	WAITING,  /* for dependencies */
+	DELAYED,  /* dependencies ready, waiting for the delay to pass */
+	ENABLING, /* setpoints and OUT1 submitted */
+	CHECKING, /* readiness query submitted */
+	IDLE,     /* between readiness queries */
+	READY,
+};
+
+struct rail {
+	char name[32], uset[16], iset[16], after[256];
+	long long delay_ns, timeout_ns;
+	const char *meas; /* readiness query, NULL if none */
+	int ge;           /* condition is meas >= thresh, otherwise <= */
+	double thresh;
+	unsigned dev, *deps, n_deps;
+	enum state st;
+	long long at;     /* end of DELAYED/IDLE state */
+	long long deadline;
+	unsigned qid;
+};
+
+static struct rail *rails;
+static unsigned n_rails;
+static char (*devs)[256];
+static struct korad **k;
+static unsigned n_devs;
+static long long t0;
+
+static long long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void report(const struct rail *r, const char *fmt, ...)
+	__attribute__((format(printf,2,3)));
+
+static void report(const struct rail *r, const char *fmt, ...)
+{
+	va_list ap;
+	printf("%9.1f ms  %s: ", (now_ns() - t0) * 1e-6, r->name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	fflush(stdout);
+}
+
+static int parse_ready(struct rail *r, const char *s)
+{
+	char what[5], op[3];
+	long ms = TIMEOUT_MS;
+	r->timeout_ns = ms * 1000000LL;
+	if (!strcmp(s, "-"))
+		return 0;
+	if (sscanf(s, "%4[a-z]%2[<>=]%lf@%ld", what, op, &r->thresh, &ms) < 3)
+		return -1;
+	if (!strcmp(what, "vout"))
+		r->meas = "VOUT1?";
+	else if (!strcmp(what, "iout"))
+		r->meas = "IOUT1?";
+	else
+		return -1;
+	if (!strcmp(op, ">="))
+		r->ge = 1;
+	else if (strcmp(op, "<="))
+		return -1;
+	r->timeout_ns = ms * 1000000LL;
+	return 0;
+}
+
+static unsigned dev_index(const char *path)
+{
+	for (unsigned i = 0; i < n_devs; i++)
+		if (!strcmp(devs[i], path))
+			return i;
+	devs = realloc(devs, sizeof(*devs) * (n_devs + 1));
+	if (!devs)
+		perror("realloc"), exit(2);
+	snprintf(devs[n_devs], sizeof(*devs), "%s", path);
+	return n_devs++;
+}
+
+static void parse(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		perror(path), exit(1);
+	char *line = NULL;
+	size_t sz = 0;
+	for (unsigned ln = 1; getline(&line, &sz, f) > 0; ln++) {
+		char dev[256], delay[16] = "0", ready[64] = "-";
+		struct rail r = { .after = "-" };
+		*strchrnul(line, '#') = '\0';
+		int n = sscanf(line, "%31s %255s %15s %15s %15s %63s %255s",
+		               r.name, dev, r.uset, r.iset, delay, ready,
+		               r.after);
+		if (n <= 0)
+			continue;
+		if (n < 4 || parse_ready(&r, ready))
+			DIE(1,"%s:%u: error: malformed rail\n",path,ln);
+		r.delay_ns = strcmp(delay, "-") ? atof(delay) * 1e6 : 0;
+		r.dev = dev_index(dev);
+		rails = realloc(rails, sizeof(*rails) * (n_rails + 1));
+		if (!rails)
+			perror("realloc"), exit(2);
+		rails[n_rails++] = r;
+	}
+	free(line);
+	fclose(f);
+}
+
+static void resolve(const char *path)
+{
+	for (unsigned i = 0; i < n_rails; i++) {
+		struct rail *r = &rails[i];
+		if (!strcmp(r->after, "-"))
+			continue;
+		char *save;
+		for (char *s = strtok_r(r->after, ",", &save); s;
+		     s = strtok_r(NULL, ",", &save)) {
+			unsigned j;
+			for (j = 0; j < n_rails && strcmp(rails[j].name, s); j++);
+			if (j == n_rails)
+				DIE(1,"%s: error: rail '%s' depends on unknown rail "
+				    "'%s'\n",path,r->name,s);
+			r->deps = realloc(r->deps,
+			                  sizeof(*r->deps) * (r->n_deps + 1));
+			if (!r->deps)
+				perror("realloc"), exit(2);
+			r->deps[r->n_deps++] = j;
+		}
+	}
+
+	/* reject cycles: repeatedly mark rails whose dependencies are all
+	 * marked */
+	unsigned marked = 0, progress = 1;
+	char m[n_rails];
+	memset(m, 0, n_rails);
+	while (progress) {
+		progress = 0;
+		for (unsigned i = 0; i < n_rails; i++) {
+			unsigned d = 0;
+			while (d < rails[i].n_deps && m[rails[i].deps[d]])
+				d++;
+			if (!m[i] && d == rails[i].n_deps)
+				m[i] = progress = 1, marked++;
+		}
+	}
+	if (marked < n_rails)
+		DIE(1,"%s: error: dependencies of rails are cyclic\n",path);
+}
+
+static int deps_ready(const struct rail *r)
+{
+	for (unsigned d = 0; d < r->n_deps; d++)
+		if (rails[r->deps[d]].st != READY)
+			return 0;
+	return 1;
+}
+
+/* Removes the cached status of all devices, whose state is changed. */
+static void drop_cache(void)
+{
+	for (unsigned i = 0; i < n_devs; i++)
+		cache_drop(devs[i]);
+}
+
+/* Turns off all rails enabled so far and returns the exit status. */
+static int abort_seq(void)
+{
+	for (unsigned i = n_rails; i--;) {
+		struct rail *r = &rails[i];
+		if (r->st < ENABLING)
+			continue;
+		if (korad_sync(k[r->dev]) ||
+		    korad_send(k[r->dev], KORAD_PACE, "OUT0"))
+			fprintf(stderr, "%s: error turning off: %s\n", r->name,
+			        strerror(errno));
+		else
+			report(r, "turned off");
+	}
+	drop_cache();
+	return 2;
+}
+
+static int fail(const struct rail *r, const char *what)
+{
+	fprintf(stderr, "%s: error: %s\n", r->name, what);
+	return abort_seq();
+}
+
+/* Advances the state of rail r at time t, returns -1 on error. */
+static int step(struct rail *r, long long t, long long *wake)
+{
+	switch (r->st) {
+	case WAITING:
+		if (!deps_ready(r))
+			break;
+		r->st = DELAYED;
+		r->at = t + r->delay_ns;
+		/* fall through */
+	case DELAYED:
+		if (t < r->at) {
+			if (r->at < *wake)
+				*wake = r->at;
+			break;
+		}
+		struct korad *kd = k[r->dev];
+		if (!korad_submit(kd, KORAD_PACE, "ISET1:%s", r->iset) ||
+		    !korad_submit(kd, KORAD_PACE, "VSET1:%s", r->uset) ||
+		    !korad_submit(kd, KORAD_PACE, "OUT1"))
+			return -1;
+		report(r, "enabling %sV / %sA", r->uset, r->iset);
+		r->st = ENABLING;
+		r->deadline = t + r->timeout_ns;
+		/* fall through */
+	case ENABLING:
+		if (!r->meas) {
+			/* no readiness condition: ready once OUT1 is written */
+			if (korad_pending(k[r->dev]))
+				break;
+			report(r, "ready");
+			r->st = READY;
+			break;
+		}
+		r->at = t;
+		/* fall through */
+	case IDLE:
+		if (t < r->at) {
+			if (r->at < *wake)
+				*wake = r->at;
+			break;
+		}
+		if (!(r->qid = korad_submit(k[r->dev], 0, "%s", r->meas)))
+			return -1;
+		r->st = CHECKING;
+		/* fall through */
+	case CHECKING:
+		if (t > r->deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (r->deadline < *wake)
+			*wake = r->deadline;
+		break;
+	case READY:
+		break;
+	}
+	return 0;
+}
+
+static void check(struct rail *r, const struct korad_reply *rep)
+{
+	double v = atof(rep->data);
+	if (r->ge ? v >= r->thresh : v <= r->thresh) {
+		report(r, "ready, %s %s", rep->cmd, rep->data);
+		r->st = READY;
+	} else {
+		r->st = IDLE;
+		r->at = now_ns() + POLL_NS;
+	}
+}
+
+int run_sequence(const char *path, int force)
+{
+	parse(path);
+	resolve(path);
+
+	k = calloc(n_devs, sizeof(*k));
+	if (!k)
+		perror("calloc"), exit(2);
+	for (unsigned i = 0; i < n_devs; i++) {
+		const char *id;
+		if (!(k[i] = korad_open(devs[i])))
+			perror(devs[i]), exit(1);
+		if (!(id = korad_query(k[i], "*IDN?")))
+			DIE(2,"%s: error reading *IDN? output\n",devs[i]);
+		const struct korad_model *m = korad_model(id);
+		if (!force && !m)
+			DIE(1,"%s: error: device identified as '%s'. Unknown, "
+			    "aborting.\n",devs[i],id);
+		korad_set_model(k[i], m ? m : &korad_generic);
+	}
+
+	drop_cache();
+	t0 = now_ns();
+	struct pollfd p[n_devs];
+	for (unsigned ready = 0; ready < n_rails;) {
+		long long t = now_ns(), wake = LLONG_MAX;
+		ready = 0;
+		for (unsigned i = 0; i < n_rails; i++) {
+			if (step(&rails[i], t, &wake))
+				return fail(&rails[i], errno == ETIMEDOUT
+				            ? "not ready in time"
+				            : strerror(errno));
+			ready += rails[i].st == READY;
+		}
+		if (ready == n_rails)
+			break;
+
+		for (unsigned i = 0; i < n_devs; i++) {
+			int to = korad_timeout(k[i]);
+			p[i].fd = korad_fd(k[i]);
+			p[i].events = korad_events(k[i]);
+			if (to >= 0 && t + to * 1000000LL < wake)
+				wake = t + to * 1000000LL;
+		}
+		int to = wake == LLONG_MAX ? -1 : (wake - t + 999999) / 1000000;
+		if (poll(p, n_devs, to) == -1 && errno != EINTR)
+			perror("poll"), exit(2);
+
+		for (unsigned i = 0; i < n_devs; i++) {
+			struct korad_reply rep;
+			int c;
+			while ((c = korad_complete(k[i], &rep)) > 0)
+				for (unsigned j = 0; j < n_rails; j++)
+					if (rails[j].dev == i &&
+					    rails[j].st == CHECKING &&
+					    rails[j].qid == rep.id)
+						check(&rails[j], &rep);
+			if (c < 0) {
+				fprintf(stderr, "%s: error: %s\n", devs[i],
+				        strerror(errno));
+				return abort_seq();
+			}
+		}
+	}
+
+	for (unsigned i = 0; i < n_devs; i++)
+		korad_close(k[i]);
+	/* and what was cached while enabling */
+	drop_cache();
+	return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * seq.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef SEQ_H
+#define SEQ_H
+
+/* Executes the power sequence described in the file 'path'. Each non-empty
+ * line not starting with '#' describes a rail:
+ *
+ *   NAME DEV VOLTAGE CURRENT [DELAY_MS [READY [AFTER]]]
+ *
+ * A rail is enabled DELAY_MS after all rails in the comma-separated list
+ * AFTER are ready. READY is a condition 'vout>=X', 'vout<=X', 'iout>=X' or
+ * 'iout<=X', optionally followed by '@MS' to wait at most MS milliseconds
+ * for it, or '-' for none. On failure, all rails enabled so far are turned
+ * off again. Returns the exit status. */
+int run_sequence(const char *path, int force);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * tlm.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#include "tlm.h"
+
+const char *const tlm_names[TLM_FIELDS] = {
+	"status", "vset", "iset", "vout", "iout",
+};
+
+void tlm_print(FILE *f, unsigned field, int32_t v)
+{
+	switch (field) {
+	case 0: fprintf(f, "0x%02x", v); break;
+	case 1:
+	case 3: fprintf(f, "%05.2f", v / 100.0); break;
+	default: fprintf(f, "%.3f", v / 1000.0); break;
+	}
+}
+
+size_t tlm_put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = v | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+int tlm_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	*v = 0;
+	for (unsigned sh = 0; *p < end && sh < 64; sh += 7) {
+		uint8_t b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << sh;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+size_t tlm_encode(uint8_t *buf, unsigned dev, const struct tlm_sample *prev,
+                  const struct tlm_sample *s, int key)
+{
+	unsigned mask = s->valid;
+	if (!key)
+		for (unsigned f = 0; f < TLM_FIELDS; f++)
+			if (prev->valid & 1U << f && prev->v[f] == s->v[f])
+				mask &= ~(1U << f);
+	size_t n = tlm_put_varint(buf, dev);
+	buf[n++] = mask | (key ? TLM_KEY : 0);
+	/* deltas wrap around like the decoder's sums */
+	n += tlm_put_varint(buf + n, key ? (uint64_t)s->t
+	                                 : (uint64_t)s->t - (uint64_t)prev->t);
+	for (unsigned f = 0; f < TLM_FIELDS; f++)
+		if (mask & 1U << f) {
+			uint64_t d = s->v[f];
+			if (!key && prev->valid & 1U << f)
+				d -= prev->v[f];
+			n += tlm_put_varint(buf + n, zigzag((int64_t)d));
+		}
+	return n;
+}
+
+int tlm_decode(const uint8_t **p, const uint8_t *end, unsigned n,
+               unsigned *dev, struct tlm_sample *prev)
+{
+	uint64_t d, t, v;
+	if (*p == end)
+		return 0;
+	if (tlm_get_varint(p, end, &d) || d >= n || *p == end)
+		return -1;
+	unsigned flags = *(*p)++, key = flags & TLM_KEY;
+	struct tlm_sample *s = &prev[*dev = d];
+	if (flags & ~(TLM_KEY | ((1U << TLM_FIELDS) - 1)) ||
+	    tlm_get_varint(p, end, &t))
+		return -1;
+	s->t = key ? (int64_t)t : (int64_t)((uint64_t)s->t + t);
+	if (key)
+		s->valid = 0;
+	for (unsigned f = 0; f < TLM_FIELDS; f++) {
+		if (!(flags & 1U << f))
+			continue;
+		if (tlm_get_varint(p, end, &v))
+			return -1;
+		uint64_t x = unzigzag(v);
+		if (!key && s->valid & 1U << f)
+			x += s->v[f];
+		s->v[f] = (int64_t)x;
+		s->valid |= 1U << f;
+	}
+	return 1;
+}
@@ -0,0 +1,73 @@
+/*
+ * tlm.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef TLM_H
+#define TLM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Binary telemetry stream
+ *
+ * The stream starts with a header
+ *
+ *   "KRDT" VERSION:u8 FIELDS:u8 T0:varint N:varint (LEN:varint NAME)*N
+ *
+ * where FIELDS is the mask of monitored fields, T0 the CLOCK_REALTIME time
+ * monitoring started in microseconds and NAME the path of the device, and is
+ * followed by records
+ *
+ *   DEV:varint FLAGS:u8 T:varint (V:svarint)*
+ *
+ * where the lower bits of FLAGS form the mask of fields V is present for.
+ * If FLAGS has TLM_KEY set, the record is a keyframe, T is the time since T0
+ * in microseconds and V are absolute values of all fields of the device
+ * known so far. Otherwise, T and V are deltas to the previous record of the
+ * same device and only those fields that changed are present. Voltages are
+ * in units of 10 mV, currents in mA and the status holds the KORAD_ST_* flags
+ * of the channel (korad.h). Unsigned varints are little-endian base-128,
+ * signed ones are zigzag-encoded.
+ *
+ * Version 1 streams carry the raw status byte instead, which only matches
+ * the flags for the KD3005P. */
+
+#define TLM_MAGIC	"KRDT"
+#define TLM_VERSION	2
+#define TLM_FIELDS	5
+#define TLM_KEY		0x80
+/* upper bound on the size of an encoded record */
+#define TLM_REC_MAX	(10 + 1 + 10 + TLM_FIELDS * 10)
+
+struct tlm_sample {
+	int64_t t;              /* microseconds since T0 */
+	int32_t v[TLM_FIELDS];
+	unsigned valid;         /* mask of fields v[] holds values for */
+};
+
+/* names of the fields as used by the monitor */
+extern const char *const tlm_names[TLM_FIELDS];
+
+/* Prints value v of field f as the device would report it. */
+void   tlm_print(FILE *f, unsigned field, int32_t v);
+
+size_t tlm_put_varint(uint8_t *p, uint64_t v);
+int    tlm_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v);
+
+/* Encodes s as a record of device 'dev' into buf, as a keyframe if 'key' is
+ * set or otherwise relative to 'prev', and returns its length. */
+size_t tlm_encode(uint8_t *buf, unsigned dev, const struct tlm_sample *prev,
+                  const struct tlm_sample *s, int key);
+
+/* Decodes the record at *p into *dev and prev[*dev], which holds the
+ * previous sample of each of the 'n' devices. Returns 1 on success, 0 at
+ * the end of the data and -1 if the record is malformed. */
+int    tlm_decode(const uint8_t **p, const uint8_t *end, unsigned n,
+                  unsigned *dev, struct tlm_sample *prev);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * wdg.c
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "korad.h"
+#include "wdg.h"
+
+/* time to wait for a reply before the device is considered stuck */
+#define REPLY_NS	500000000LL
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static long long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static long long ts_ns(struct timespec t)
+{
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int open_heartbeat(const char *path)
+{
+	if (!strcmp(path, "-"))
+		return STDIN_FILENO;
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(a.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(a.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	                0);
+	if (fd == -1)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&a, sizeof(a))) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	return fd;
+}
+
+/* Consumes the heartbeats signalled readable on fd. Returns 1 if there
+ * were any, 0 if not and -1 at the end of input or on errors. */
+static int beat(int fd)
+{
+	char buf[256];
+	ssize_t rd;
+	if (fd == STDIN_FILENO) {
+		/* one read does not block after POLLIN */
+		while ((rd = read(fd, buf, sizeof(buf))) == -1 &&
+		       errno == EINTR);
+		if (!rd)
+			errno = 0;
+		return rd > 0 ? 1 : -1;
+	}
+	int r = 0;
+	/* datagrams may be empty */
+	while ((rd = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+		r = 1;
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? r
+	                                                                 : -1;
+}
+
+/* Makes the loop's timing independent of other load if permitted. */
+static void realtime(void)
+{
+	struct sched_param sp = { .sched_priority = 1 };
+	mlockall(MCL_CURRENT | MCL_FUTURE);
+	sched_setscheduler(0, SCHED_FIFO, &sp);
+}
+
+/* Sends OUT0 to all devices as their next command and waits for it to be
+ * written. Devices not accepting it within REPLY_NS get it written
+ * directly on a line of its own. */
+static void cut(struct korad *const *k, const char *const *devs, unsigned n,
+                long long t_trip)
+{
+	struct pollfd p[n];
+	int done[n];
+	for (unsigned i = 0; i < n; i++)
+		done[i] = korad_submit(k[i], 0, "OUT0") ? 0 : -1;
+	for (unsigned left = n; left;) {
+		long long t = now_ns(), wake = t_trip + REPLY_NS;
+		if (t >= wake)
+			break;
+		left = 0;
+		for (unsigned i = 0; i < n; i++) {
+			struct korad_reply r;
+			int c;
+			if (!done[i]) {
+				while ((c = korad_complete(k[i], &r)) > 0);
+				if (c < 0 || !korad_pending(k[i]))
+					done[i] = c < 0 ? -1 : 1;
+			}
+			p[i].fd = korad_fd(k[i]);
+			p[i].events = done[i] ? 0 : korad_events(k[i]);
+			int to = done[i] ? -1 : korad_timeout(k[i]);
+			if (to >= 0 && t + to * 1000000LL < wake)
+				wake = t + to * 1000000LL;
+			left += !done[i];
+		}
+		if (!left)
+			break;
+		struct timespec ts = { (wake - t) / 1000000000,
+		                       (wake - t) % 1000000000 };
+		if (ppoll(p, n, &ts, NULL) == -1 && errno != EINTR)
+			break;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		if (done[i] > 0) {
+			fprintf(stderr, "%s: output off after %.3f ms\n",
+			        devs[i],
+			        (ts_ns(korad_written(k[i])) - t_trip) * 1e-6);
+			continue;
+		}
+		/* last resort, the device did not reply in time; the line
+		 * terminator first ends a command the handle wrote in part */
+		if (write(korad_fd(k[i]), "\nOUT0\n", 6) == 6)
+			fprintf(stderr, "%s: OUT0 written after %.3f ms "
+			        "without waiting for the device\n", devs[i],
+			        (now_ns() - t_trip) * 1e-6);
+		else
+			fprintf(stderr, "%s: error: cannot turn output off: "
+			        "%s\n", devs[i], strerror(errno));
+	}
+}
+
+int run_watchdog(struct korad *const *k, const char *const *devs, unsigned n,
+                 const struct wdg_opts *o)
+{
+	static const char *const query[] = { "VOUT%u?", "IOUT%u?" };
+	const double lim[] = { o->vmax, o->imax };
+	/* step: channel * 2 + index into query[] */
+	unsigned qid[n], step[n], n_steps[n];
+	struct pollfd p[n + 1];
+	char why[128] = "";
+	int hb = -1, err = 0;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (unsigned i = 0; i < n; i++) {
+		qid[i] = 0;
+		step[i] = !lim[0] && lim[1];
+		n_steps[i] = 2 * korad_get_model(k[i])->channels;
+		if (ioctl(korad_fd(k[i]), TIOCEXCL) == -1)
+			fprintf(stderr, "%s: warning: cannot lock device: %s\n",
+			        devs[i], strerror(errno));
+	}
+	/* errors turn the outputs off as well */
+	if (o->heartbeat && (hb = open_heartbeat(o->heartbeat)) == -1) {
+		snprintf(why, sizeof(why), "%s: %s", o->heartbeat,
+		         strerror(errno));
+		err = 1;
+	}
+	realtime();
+
+	long long t_beat = now_ns();
+	while (!stop && !*why) {
+		long long t = now_ns(), wake = LLONG_MAX;
+		if (hb >= 0) {
+			if (t - t_beat >= o->timeout_ns) {
+				snprintf(why, sizeof(why), "no heartbeat for "
+				         "%.3f ms", (t - t_beat) * 1e-6);
+				break;
+			}
+			wake = t_beat + o->timeout_ns;
+		}
+		for (unsigned i = 0; i < n; i++) {
+			if (!qid[i] && (lim[0] || lim[1]) &&
+			    !(qid[i] = korad_submit(k[i], 0, query[step[i] % 2],
+			                            step[i] / 2 + 1))) {
+				snprintf(why, sizeof(why), "%s: error: %s",
+				         devs[i], strerror(errno));
+				err = 1;
+				break;
+			}
+			p[i].fd = korad_fd(k[i]);
+			p[i].events = korad_events(k[i]);
+			if (p[i].events == POLLIN) {
+				long long w = ts_ns(korad_written(k[i]));
+				if (t - w >= REPLY_NS) {
+					snprintf(why, sizeof(why), "%s: no reply "
+					         "for %.3f ms", devs[i],
+					         (t - w) * 1e-6);
+					break;
+				}
+				if (w + REPLY_NS < wake)
+					wake = w + REPLY_NS;
+			}
+			int to = korad_timeout(k[i]);
+			if (to >= 0 && t + to * 1000000LL < wake)
+				wake = t + to * 1000000LL;
+		}
+		if (*why)
+			break;
+		p[n].fd = hb;
+		p[n].events = POLLIN;
+
+		struct timespec ts, *tp = NULL;
+		if (wake != LLONG_MAX) {
+			long long d = wake > t ? wake - t : 0;
+			ts = (struct timespec){ d / 1000000000,
+			                        d % 1000000000 };
+			tp = &ts;
+		}
+		if (ppoll(p, n + (hb >= 0), tp, NULL) == -1 &&
+		    errno != EINTR) {
+			snprintf(why, sizeof(why), "poll: %s", strerror(errno));
+			err = 1;
+			break;
+		}
+
+		if (hb >= 0 && p[n].revents) {
+			int r = beat(hb);
+			if (r < 0) {
+				snprintf(why, sizeof(why), "heartbeat %s",
+				         errno ? strerror(errno) : "closed");
+				break;
+			}
+			if (r)
+				t_beat = now_ns();
+		}
+		for (unsigned i = 0; i < n && !*why; i++) {
+			struct korad_reply r;
+			int c;
+			while ((c = korad_complete(k[i], &r)) > 0) {
+				if (r.id != qid[i])
+					continue;
+				double v = atof(r.data), l = lim[step[i] % 2];
+				if (l && v > l) {
+					snprintf(why, sizeof(why), "%s: %s %s "
+					         "exceeds %g", devs[i], r.cmd,
+					         r.data, l);
+					break;
+				}
+				qid[i] = 0;
+				do
+					step[i] = (step[i] + 1) % n_steps[i];
+				while (!lim[step[i] % 2]);
+			}
+			if (c < 0) {
+				snprintf(why, sizeof(why), "%s: error: %s",
+				         devs[i], strerror(errno));
+				err = 1;
+			}
+		}
+	}
+
+	if (hb >= 0 && hb != STDIN_FILENO) {
+		close(hb);
+		unlink(o->heartbeat);
+	}
+	if (!*why) {
+		/* leave no reply behind for the next user of the device */
+		for (unsigned i = 0; i < n; i++)
+			korad_sync(k[i]);
+		return 0;
+	}
+	long long t_trip = now_ns();
+	fprintf(stderr, "watchdog: %s, turning outputs off\n", why);
+	cut(k, devs, n, t_trip);
+	return err ? 2 : 3;
+}
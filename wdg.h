@@ -0,0 +1,36 @@
+/*
+ * wdg.h
+ *
+ * Copyright 2022 Franz Brauße <fb@paxle.org>
+ *
+ * SPDX: WTFPL
+ */
+
+#ifndef WDG_H
+#define WDG_H
+
+struct korad;
+
+struct wdg_opts {
+	const char *heartbeat;   /* socket path, "-" for stdin, NULL: none */
+	long long timeout_ns;    /* maximum time between heartbeats */
+	double vmax, imax;       /* limits of VOUTn? and IOUTn?, 0: none */
+};
+
+/* Guards the outputs of all devices until SIGINT or SIGTERM is received.
+ * The devices are opened exclusively and the output voltage and current of
+ * all their channels are queried back-to-back. If no heartbeat arrives within
+ * 'timeout_ns' or either limit is exceeded on any channel, OUT0 is sent to all
+ * devices as the next command, i.e. at most one reply later, and monitoring
+ * ends.
+ *
+ * Heartbeats are datagrams of any content sent to the Unix socket
+ * 'heartbeat', which is created, or any input on stdin if it is "-". End of
+ * input counts as missing heartbeat. Errors, e.g. a reply that cannot be
+ * read, turn the outputs off just the same. Returns 0 if terminated by a
+ * signal, 3 if the outputs were turned off and 2 if that was due to an
+ * error. */
+int run_watchdog(struct korad *const *k, const char *const *devs, unsigned n,
+                 const struct wdg_opts *o);
+
+#endif